@@ -1,6 +1,7 @@
 #pragma once
 
 #include <climits>
+#include <limits>
 
 #define overload_infix(B,R,T)    inline T  operator R   (const T& x, B y) { return T((B)x R y); }
 #define overload_compound(B,R,T) inline T& operator R##=(      T& x, B y) { return ( x = operator R(x,y) ); } 
@@ -0,0 +1,1131 @@
+/////////////////////////////////
+//                             //
+// bench                       //
+// codec benchmark harness     //
+//                             //
+// Copyright(c) 2016 256 LLC   //
+// Written by Christopher Abad //
+// aempirei@256.bz             //
+// 20 GOTO 10                  //
+//                             //
+/////////////////////////////////
+
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+#include <csignal>
+
+#include <string>
+#include <sstream>
+#include <list>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <algorithm>
+
+extern "C" {
+#include <unistd.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+}
+
+#include <config.hh>
+#include <libpz.hh>
+
+//
+// a codec is a tool in the bin directory with the arguments that make it
+// compress stdin to stdout, and decompress it back if it can
+//
+
+struct codec {
+	const char *name;
+	std::list<std::string> compress;
+	std::list<std::string> decompress;
+	bool leveled;
+};
+
+const static std::list<codec> codecs = {
+	{ "pzip", { "-c" },       { "-d", "-c" }, true },
+	{ "rzip", { "-c", "-f" }, { },            true },
+};
+
+struct run {
+	bool ok = false;
+	bool expired = false;
+	double seconds = 0;
+	double cpu = 0;
+	long rss = 0;
+	size_t bytes = 0;
+	std::map<std::string,double> phases; // wall seconds, from --stats
+};
+
+struct result {
+	std::string corpus;
+	std::string codec;
+	size_t level;
+	size_t input;
+	run compress;
+	run decompress;
+	bool decompressed;
+	bool roundtrip;
+};
+
+//
+// corpora
+//
+
+struct prng {
+
+	uint64_t x;
+
+	prng(uint64_t seed) : x(seed) {
+	}
+
+	uint64_t operator()() {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		return x;
+	}
+
+	size_t below(size_t n) {
+		return operator()() % n;
+	}
+
+	size_t skewed(size_t n) {
+		// roughly zipf, small values are much more likely
+		return below(below(below(n) + 1) + 1);
+	}
+};
+
+const static std::vector<std::string> words = {
+	"the", "of", "and", "to", "in", "is", "that", "it", "was", "for", "on", "are", "with", "as",
+	"be", "at", "by", "this", "have", "from", "or", "one", "had", "not", "but", "what", "all",
+	"were", "when", "we", "there", "can", "an", "your", "which", "their", "said", "if", "will",
+	"each", "about", "how", "up", "out", "them", "then", "she", "many", "some", "so", "these",
+	"would", "other", "into", "has", "more", "her", "two", "like", "him", "see", "time", "could",
+	"no", "make", "than", "first", "been", "its", "who", "now", "people", "my", "made", "over",
+	"did", "down", "only", "way", "find", "use", "may", "water", "long", "little", "very",
+	"after", "words", "called", "just", "where", "most", "know", "grammar", "symbol", "rule"
+};
+
+std::string corpus_text(size_t sz) {
+
+	prng g(1);
+	std::string s;
+
+	while(s.size() < sz) {
+		size_t n = 4 + g.below(12);
+		for(size_t i = 0; i < n; i++) {
+			std::string w = words[g.skewed(words.size())];
+			if(i == 0)
+				w[0] = toupper(w[0]);
+			s += w;
+			s += (i + 1 < n) ? " " : ".";
+		}
+		s += g.below(4) ? " " : "\n\n";
+	}
+
+	s.resize(sz);
+	return s;
+}
+
+std::string corpus_logs(size_t sz) {
+
+	const static std::vector<std::string> daemons = { "sshd", "cron", "kernel", "nginx", "postfix/smtpd" };
+	const static std::vector<std::string> events = {
+		"Accepted publickey for deploy from",
+		"Failed password for invalid user admin from",
+		"connect from",
+		"GET /api/v1/status HTTP/1.1 200 from",
+		"session opened for user root by",
+	};
+
+	prng g(2);
+	std::string s;
+	size_t t = 1451606400;
+
+	while(s.size() < sz) {
+
+		std::stringstream ss;
+
+		t += g.below(3);
+
+		ss << "2016-01-" << std::setfill('0') << std::setw(2) << (1 + t / 86400 % 28) << 'T';
+		ss << std::setw(2) << (t / 3600 % 24) << ':' << std::setw(2) << (t / 60 % 60) << ':' << std::setw(2) << (t % 60);
+		ss << '.' << std::setw(3) << g.below(1000) << "Z host" << g.skewed(32) << ' ';
+		ss << daemons[g.skewed(daemons.size())] << '[' << 1000 + g.below(30000) << "]: ";
+		ss << events[g.skewed(events.size())] << " 10.0." << g.skewed(8) << '.' << g.below(256);
+		ss << " port " << 1024 + g.below(60000) << std::endl;
+
+		s += ss.str();
+	}
+
+	s.resize(sz);
+	return s;
+}
+
+std::string corpus_binary(size_t sz) {
+
+	prng g(3);
+	std::string s;
+
+	uint32_t id = 0;
+
+	while(s.size() < sz) {
+
+		struct {
+			uint32_t id;
+			uint16_t type;
+			uint16_t flags;
+			int32_t delta;
+			float value;
+		} record = { id++, (uint16_t)g.skewed(16), (uint16_t)(g.below(8) ? 0 : g.below(65536)), (int32_t)g.skewed(1000) - 10, (float)g.below(100000) / 100 };
+
+		s.append((const char *)&record, sizeof(record));
+	}
+
+	s.resize(sz);
+	return s;
+}
+
+std::string corpus_random(size_t sz) {
+
+	prng g(4);
+	std::string s;
+
+	while(s.size() < sz)
+		s.push_back((char)g());
+
+	return s;
+}
+
+std::string corpus_repetitive(size_t sz) {
+
+	prng g(5);
+	std::string motif = "<record kind=\"heartbeat\" status=\"ok\"/>\n";
+	std::string s;
+
+	while(s.size() < sz) {
+		s += motif;
+		if(g.below(64) == 0)
+			s.back() = '0' + g.below(10);
+		if(s.back() != '\n')
+			s += '\n';
+	}
+
+	s.resize(sz);
+	return s;
+}
+
+const static std::vector<std::pair<const char *, std::function<std::string(size_t)>>> generators = {
+	{ "text",       corpus_text       },
+	{ "logs",       corpus_logs       },
+	{ "binary",     corpus_binary     },
+	{ "random",     corpus_random     },
+	{ "repetitive", corpus_repetitive },
+};
+
+std::string corpus_property(uint64_t seed, size_t maxsz) {
+
+	// inputs of every size from empty up to maxsz, pieced together from
+	// runs, small alphabets, gapped patterns, copies of earlier pieces and
+	// slices of the other corpora
+
+	prng g(seed * 0x9e3779b97f4a7c15 + 1);
+
+	const size_t sz = g.below(4) == 0 ? g.below(16) : g.skewed(maxsz + 1);
+
+	std::string s;
+
+	while(s.size() < sz) {
+
+		const size_t n = 1 + g.skewed(sz - s.size());
+
+		switch(g.below(5)) {
+
+			case 0:
+				s.append(n, (char)g());
+				break;
+
+			case 1: {
+				const size_t base = g.below(256);
+				const size_t k = 1 + g.skewed(256);
+				for(size_t i = 0; i < n; i++)
+					s.push_back((char)(base + g.below(k)));
+				break;
+			}
+
+			case 2: {
+				const char x = g();
+				const char y = g();
+				const size_t gap = 1 + g.below(4);
+				for(size_t i = 0; i < n; i += gap + 2) {
+					s.push_back(x);
+					for(size_t j = 0; j < gap; j++)
+						s.push_back((char)g.below(4));
+					s.push_back(y);
+				}
+				break;
+			}
+
+			case 3:
+				if(not s.empty()) {
+					const size_t p = g.below(s.size());
+					s += s.substr(p, n);
+					break;
+				}
+				// fall through
+
+			default:
+				s += generators[g.below(generators.size())].second(n);
+				break;
+		}
+	}
+
+	s.resize(sz);
+	return s;
+}
+
+//
+// running tools
+//
+
+static unsigned int time_limit = 0;
+
+run execute(const std::string& tool, const std::list<std::string>& args, const std::string& in, const std::string& out) {
+
+	run r;
+
+	std::vector<char *> argv;
+
+	argv.push_back((char *)tool.c_str());
+	for(const auto& arg : args)
+		argv.push_back((char *)arg.c_str());
+	argv.push_back(nullptr);
+
+	auto start = std::chrono::steady_clock::now();
+
+	pid_t pid = fork();
+
+	if(pid == -1)
+		return r;
+
+	if(pid == 0) {
+
+		int fdin = open(in.c_str(), O_RDONLY);
+		int fdout = open(out.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0664);
+		int fderr = open("/dev/null", O_WRONLY);
+
+		if(fdin == -1 or fdout == -1 or fderr == -1)
+			_exit(127);
+
+		dup2(fdin, STDIN_FILENO);
+		dup2(fdout, STDOUT_FILENO);
+		dup2(fderr, STDERR_FILENO);
+
+		// a pending alarm survives execv() and kills a tool that hangs
+
+		if(time_limit > 0)
+			alarm(time_limit);
+
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+
+	int status;
+	struct rusage ru;
+
+	if(wait4(pid, &status, 0, &ru) == -1)
+		return r;
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	struct stat sb;
+
+	r.ok = WIFEXITED(status) and WEXITSTATUS(status) == 0;
+	r.expired = WIFSIGNALED(status) and WTERMSIG(status) == SIGALRM;
+	r.seconds = elapsed.count();
+	r.cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	r.rss = ru.ru_maxrss;
+	r.bytes = (stat(out.c_str(), &sb) == 0) ? sb.st_size : 0;
+
+	return r;
+}
+
+//
+// the phases of a run, summed over its blocks, come from the --stats file of
+// the tool. each block writes its phases on one line as "name": { "wall": x,
+// "cpu": y }. modelling is the grammar work of a compressor, encoding the
+// output of rules and document, expansion the work of a decompressor.
+//
+
+std::map<std::string,double> read_phases(const std::string& file) {
+
+	std::ifstream f(file);
+	const std::string s((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	const std::string key = "\"phases\": {";
+
+	std::map<std::string,double> phases;
+
+	for(size_t p = s.find(key); p != std::string::npos; p = s.find(key, p)) {
+
+		const size_t eol = s.find('\n', p);
+
+		for(p = s.find('"', p + key.size()); p < eol; p = s.find('"', p)) {
+
+			const size_t q = s.find('"', p + 1);
+			const size_t w = s.find("\"wall\": ", q);
+
+			if(q == std::string::npos or w == std::string::npos)
+				return phases;
+
+			phases[s.substr(p + 1, q - p - 1)] += strtod(s.c_str() + w + 8, nullptr);
+
+			p = s.find('}', w);
+		}
+	}
+
+	return phases;
+}
+
+double phase_sum(const run& r, std::initializer_list<const char *> names) {
+
+	double sum = 0;
+
+	for(const char *name : names) {
+		auto x = r.phases.find(name);
+		if(x != r.phases.end())
+			sum += x->second;
+	}
+
+	return sum;
+}
+
+double modelling(const run& r) {
+	return phase_sum(r, { "probe", "share", "repeats", "induce", "remap" });
+}
+
+double encoding(const run& r) {
+	return phase_sum(r, { "write", "store" });
+}
+
+double expansion(const run& r) {
+	return phase_sum(r, { "parse", "expand" });
+}
+
+bool same_file(const std::string& a, const std::string& b) {
+
+	// a file that is missing compares unequal, even to another missing
+	// one, as a failed stream reads as empty
+
+	struct stat sa, sb;
+
+	if(stat(a.c_str(), &sa) != 0 or stat(b.c_str(), &sb) != 0 or sa.st_size != sb.st_size)
+		return false;
+
+	std::ifstream fa(a, std::ios::binary);
+	std::ifstream fb(b, std::ios::binary);
+	return std::equal(std::istreambuf_iterator<char>(fa), std::istreambuf_iterator<char>(), std::istreambuf_iterator<char>(fb), std::istreambuf_iterator<char>());
+}
+
+//
+// property testing
+//
+// with -p n, n generated inputs of every size and shape go through each codec
+// at each level and must decompress back to themselves, twice over when two
+// streams are concatenated, while bytes after a stream must be refused. with
+// -R dir the codecs in dir are the reference: each side must decompress what
+// the other one compressed, and a codec that cannot decompress must compress
+// exactly as its reference does. inputs that fail are kept, named after their
+// seed.
+//
+
+struct failure {
+	std::string codec;
+	size_t level;
+	uint64_t seed;
+	std::string what;
+	std::string input;
+};
+
+std::list<std::string> check(const codec& c, const std::string& tool, const std::string& reference, const std::list<std::string>& args, const std::string& input, const std::string& tmpdir) {
+
+	std::list<std::string> failed;
+
+	const std::string packed = tmpdir + "/packed";
+	const std::string unpacked = tmpdir + "/unpacked";
+	const std::string refpacked = tmpdir + "/refpacked";
+
+	auto failed_run = [](const run& r, const char *what) {
+		return std::string(what) + (r.expired ? " timed out" : " failed");
+	};
+
+	run r = execute(tool, args, input, packed);
+
+	if(not r.ok) {
+		failed.push_back(failed_run(r, "compress"));
+		return failed;
+	}
+
+	if(not c.decompress.empty()) {
+		r = execute(tool, c.decompress, packed, unpacked);
+		if(not r.ok)
+			failed.push_back(failed_run(r, "decompress"));
+		else if(not same_file(input, unpacked))
+			failed.push_back("roundtrip differs");
+	}
+
+	// two streams one after the other decompress to the input twice, and
+	// bytes after the last stream are an error
+
+	if(not c.decompress.empty() and failed.empty()) {
+
+		const std::string twice = tmpdir + "/twice";
+		const std::string doubled = tmpdir + "/doubled";
+
+		std::ifstream fi(input, std::ios::binary);
+		std::ifstream fp(packed, std::ios::binary);
+		std::stringstream si, sp;
+
+		si << fi.rdbuf();
+		sp << fp.rdbuf();
+
+		std::ofstream(twice, std::ios::binary) << sp.str() << sp.str();
+		std::ofstream(doubled, std::ios::binary) << si.str() << si.str();
+
+		r = execute(tool, c.decompress, twice, unpacked);
+
+		if(not r.ok)
+			failed.push_back(failed_run(r, "concatenated decompress"));
+		else if(not same_file(doubled, unpacked))
+			failed.push_back("concatenated roundtrip differs");
+
+		std::ofstream(twice, std::ios::binary) << sp.str() << "x";
+
+		if(execute(tool, c.decompress, twice, unpacked).ok)
+			failed.push_back("trailing garbage accepted");
+	}
+
+	if(reference.empty())
+		return failed;
+
+	r = execute(reference, args, input, refpacked);
+
+	if(not r.ok) {
+		failed.push_back(failed_run(r, "reference compress"));
+		return failed;
+	}
+
+	if(c.decompress.empty()) {
+
+		if(not same_file(packed, refpacked))
+			failed.push_back("output differs from reference");
+
+	} else {
+
+		if(not execute(reference, c.decompress, packed, unpacked).ok or not same_file(input, unpacked))
+			failed.push_back("reference cannot decompress output");
+
+		if(not execute(tool, c.decompress, refpacked, unpacked).ok or not same_file(input, unpacked))
+			failed.push_back("cannot decompress reference output");
+	}
+
+	return failed;
+}
+
+//
+// with -p the message api is checked as well, against a dictionary pzip
+// trains on generated corpora: each input, cut into messages, must
+// compress into pz_message_bound bytes, be refused a buffer one byte
+// shorter than it needs, and decompress back to itself
+//
+
+constexpr size_t message_size = 4096;
+
+bool train_messages(const std::string& bindir, const std::string& tmpdir, pz_dictionary& d) {
+
+	const std::string dict = tmpdir + "/dict";
+
+	std::list<std::string> args = { "--train=" + dict };
+
+	for(const char *name : { "text", "logs", "binary" }) {
+		for(const auto& g : generators) {
+			if(strcmp(g.first, name) == 0) {
+				const std::string path = tmpdir + "/" + name;
+				std::ofstream(path, std::ios::binary) << g.second(64 << 10);
+				args.push_back(path);
+			}
+		}
+	}
+
+	bool ok = execute(bindir + "/pzip", args, "/dev/null", tmpdir + "/trained").ok;
+
+	for(const auto& arg : args)
+		if(arg.compare(0, 2, "--") != 0)
+			unlink(arg.c_str());
+
+	unlink((tmpdir + "/trained").c_str());
+
+	if(not ok)
+		return false;
+
+	try {
+		d.load(dict);
+	} catch(const std::exception&) {
+		ok = false;
+	}
+
+	unlink(dict.c_str());
+
+	return ok;
+}
+
+std::list<std::string> check_messages(const pz_dictionary& d, const std::string& s) {
+
+	std::list<std::string> failed;
+
+	std::vector<uint8_t> packed;
+	std::vector<uint8_t> back;
+
+	for(size_t p = 0; p == 0 or p < s.size(); p += message_size) {
+
+		const size_t sz = std::min(message_size, s.size() - p);
+
+		packed.resize(pz_message_bound(sz));
+		back.resize(sz);
+
+		const size_t n = pz_message_compress(d, s.data() + p, sz, packed.data(), packed.size());
+
+		if(n == pz_message_error) {
+			failed.push_back("message compress failed");
+			break;
+		}
+
+		if(pz_message_decompress(d, packed.data(), n, back.data(), back.size()) != sz or memcmp(back.data(), s.data() + p, sz) != 0) {
+			failed.push_back("message roundtrip differs");
+			break;
+		}
+
+		if(n > 0 and pz_message_compress(d, s.data() + p, sz, packed.data(), n - 1) != pz_message_error) {
+			failed.push_back("message compress overran its buffer");
+			break;
+		}
+	}
+
+	return failed;
+}
+
+//
+// a dictionary past pz_message_rules: its last rule, abcdefgh, has no token,
+// so messages of it must step back to rule 0, abcd, and come out no larger
+// than with a dictionary that lacks the last rule
+//
+
+std::list<std::string> check_message_rules(const std::string& input) {
+
+	std::list<std::string> failed;
+
+	std::vector<std::vector<uint16_t>> bodies = { { 'a', 'b', 'c', 'd' } };
+
+	while(bodies.size() < pz_message_rules)
+		bodies.push_back({ 0xff, (uint16_t)(bodies.size() >> 8 & 0xff), (uint16_t)(bodies.size() & 0xff) });
+
+	pz_dictionary shorter;
+	shorter.build(bodies);
+
+	bodies.push_back({ 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h' });
+
+	pz_dictionary longer;
+	longer.build(bodies);
+
+	std::string s;
+
+	while(s.size() < message_size)
+		s += "abcdefgh";
+
+	std::ofstream(input, std::ios::binary) << s;
+
+	std::vector<uint8_t> packed(pz_message_bound(s.size()));
+	std::vector<uint8_t> back(s.size());
+
+	const size_t n = pz_message_compress(longer, s.data(), s.size(), packed.data(), packed.size());
+
+	if(n == pz_message_error) {
+		failed.push_back("message compress failed");
+		return failed;
+	}
+
+	if(pz_message_decompress(longer, packed.data(), n, back.data(), back.size()) != s.size() or memcmp(back.data(), s.data(), s.size()) != 0)
+		failed.push_back("message roundtrip differs");
+
+	if(n > pz_message_compress(shorter, s.data(), s.size(), packed.data(), packed.size()))
+		failed.push_back("message rule past pz_message_rules not stepped back from");
+
+	return failed;
+}
+
+//
+// with -p pzip also compresses an input several times memory_budget with
+// --memory set to it, out of core, and must decompress it back with a peak
+// heap, from its --stats, of at most memory_slack times the budget
+//
+
+constexpr size_t memory_budget = 8 << 20;
+constexpr double memory_slack = 1.5;
+
+size_t read_peak_heap(const std::string& file) {
+
+	std::ifstream f(file);
+	const std::string s((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	const std::string key = "\"peak_heap_bytes\": ";
+	const size_t p = s.find(key);
+
+	return p == std::string::npos ? 0 : strtoull(s.c_str() + p + key.size(), nullptr, 10);
+}
+
+std::list<std::string> check_memory(const std::string& tool, const std::string& input, const std::string& tmpdir) {
+
+	std::list<std::string> failed;
+
+	const std::string packed = tmpdir + "/packed";
+	const std::string unpacked = tmpdir + "/unpacked";
+	const std::string stats = tmpdir + "/stats";
+
+	{
+		std::ofstream f(input, std::ios::binary);
+		for(const auto& g : generators)
+			f << g.second(memory_budget / 2);
+	}
+
+	run r = execute(tool, { "-c", "--memory=" + std::to_string(memory_budget) }, input, packed);
+
+	if(not r.ok) {
+		failed.push_back(r.expired ? "out of core compress timed out" : "out of core compress failed");
+		return failed;
+	}
+
+	r = execute(tool, { "-d", "-c", "--stats=" + stats }, packed, unpacked);
+
+	const size_t peak = read_peak_heap(stats);
+
+	unlink(stats.c_str());
+
+	if(not r.ok)
+		failed.push_back(r.expired ? "out of core decompress timed out" : "out of core decompress failed");
+	else if(not same_file(input, unpacked))
+		failed.push_back("out of core roundtrip differs");
+	else if(peak == 0 or peak > memory_slack * memory_budget)
+		failed.push_back("out of core decompress peak heap of " + std::to_string(peak) + " bytes");
+
+	return failed;
+}
+
+//
+// reporting
+//
+
+double mbps(size_t bytes, double seconds) {
+	return seconds > 0 ? bytes / seconds / (1 << 20) : 0;
+}
+
+void print_csv(std::ostream& os, const std::list<result>& results) {
+
+	os << "corpus,codec,level,input_bytes,output_bytes,ratio,";
+	os << "compress_s,compress_cpu_s,compress_mbps,compress_rss_kb,model_s,encode_s,";
+	os << "decompress_s,decompress_cpu_s,decompress_mbps,decompress_rss_kb,expand_s,roundtrip" << std::endl;
+
+	for(const auto& x : results) {
+
+		os << x.corpus << ',' << x.codec << ',' << x.level << ',' << x.input << ',' << x.compress.bytes << ',';
+		os << std::fixed << std::setprecision(4) << (x.compress.bytes ? (double)x.input / x.compress.bytes : 0) << ',';
+		os << x.compress.seconds << ',' << x.compress.cpu << ',' << mbps(x.input, x.compress.seconds) << ',' << x.compress.rss << ',';
+		os << modelling(x.compress) << ',' << encoding(x.compress) << ',';
+
+		if(x.decompressed)
+			os << x.decompress.seconds << ',' << x.decompress.cpu << ',' << mbps(x.input, x.decompress.seconds) << ',' << x.decompress.rss << ',' << expansion(x.decompress) << ',';
+		else
+			os << ",,,,,";
+
+		os << (x.decompressed ? (x.roundtrip ? "ok" : "FAILED") : (x.compress.ok ? "n/a" : "FAILED")) << std::endl;
+	}
+}
+
+void print_json(std::ostream& os, const std::list<result>& results) {
+
+	auto phase = [&os](const char *name, const run& r, size_t input) {
+		os << '"' << name << "\": { \"ok\": " << (r.ok ? "true" : "false") << ", \"seconds\": " << r.seconds << ", \"cpu_seconds\": " << r.cpu;
+		os << ", \"mbps\": " << mbps(input, r.seconds) << ", \"rss_kb\": " << r.rss << ", \"bytes\": " << r.bytes << ", \"phases\": {";
+		for(auto x = r.phases.begin(); x != r.phases.end(); x++)
+			os << (x == r.phases.begin() ? " \"" : ", \"") << x->first << "\": " << x->second;
+		os << " } }";
+	};
+
+	os << '[' << std::endl;
+
+	for(auto x = results.begin(); x != results.end(); x++) {
+
+		os << "  { \"corpus\": \"" << x->corpus << "\", \"codec\": \"" << x->codec << "\", \"level\": " << x->level;
+		os << ", \"input_bytes\": " << x->input << ", \"output_bytes\": " << x->compress.bytes;
+		os << std::fixed << std::setprecision(4) << ", \"ratio\": " << (x->compress.bytes ? (double)x->input / x->compress.bytes : 0);
+		os << ", \"model_s\": " << modelling(x->compress) << ", \"encode_s\": " << encoding(x->compress);
+		if(x->decompressed)
+			os << ", \"expand_s\": " << expansion(x->decompress);
+		os << ", ";
+
+		phase("compress", x->compress, x->input);
+
+		if(x->decompressed) {
+			os << ", ";
+			phase("decompress", x->decompress, x->input);
+			os << ", \"roundtrip\": " << (x->roundtrip ? "true" : "false");
+		}
+
+		os << " }" << (std::next(x) == results.end() ? "" : ",") << std::endl;
+	}
+
+	os << ']' << std::endl;
+}
+
+void usage(const char *prog) {
+	std::cerr << prog << " codec benchmark." << std::endl << std::endl;
+	std::cerr << "usage: " << prog << " [option]... [file]..." << std::endl << std::endl;
+	std::cerr << "\t-h\t\tprint this message" << std::endl;
+	std::cerr << "\t--json\t\twrite json instead of csv" << std::endl;
+	std::cerr << "\t-s size\t\tsize of each generated corpus (default 256K)" << std::endl;
+	std::cerr << "\t-L levels\tcomma separated levels to run (default 1,2,9)" << std::endl;
+	std::cerr << "\t-C codec\tonly run this codec (repeatable)" << std::endl;
+	std::cerr << "\t-B dir\t\tdirectory holding the codec binaries (default: next to " << prog << ")" << std::endl;
+	std::cerr << "\t-o file\t\twrite results to file instead of stdout" << std::endl;
+	std::cerr << "\t-p n\t\tround trip n generated inputs of up to -s bytes instead of benchmarking" << std::endl;
+	std::cerr << "\t-S seed\t\tseed of the first generated input (default 1)" << std::endl;
+	std::cerr << "\t-R dir\t\tdirectory holding reference codec binaries to compare against with -p" << std::endl;
+	std::cerr << "\t-T sec\t\tkill a codec run after sec seconds (default none, 60 with -p)" << std::endl << std::endl;
+	std::cerr << "Files given on the command line are used as the corpus instead of generated data." << std::endl;
+	std::cerr << "With -p, the message api is checked too, as codec \"message\"." << std::endl;
+	std::cerr << "Modelling, encoding and expansion times come from the --stats output of the codecs." << std::endl;
+	std::cerr << "With -p, failing inputs are kept and listed, and the exit status is 1." << std::endl << std::endl;
+}
+
+int main(int argc, char **argv) {
+
+	bool json = false;
+	size_t corpus_sz = 256 << 10;
+	std::list<size_t> levels = { 1, 2, 9 };
+	std::list<std::string> only;
+	std::string bindir;
+	std::string refdir;
+	std::string output;
+	size_t properties = 0;
+	uint64_t seed = 1;
+	bool limited = false;
+
+	enum { json_option = 256 };
+
+	const static struct option options[] = {
+		{ "json",  no_argument, nullptr, json_option },
+		{ nullptr, 0,           nullptr, 0           }
+	};
+
+	int opt;
+	unsigned long long n;
+
+	while ((opt = getopt_long(argc, argv, "hs:L:C:B:o:p:S:R:T:", options, nullptr)) != -1) {
+
+		switch (opt) {
+
+			case 'h': usage(*argv); return 0;
+			case json_option: json = true; break;
+			case 'C': only.push_back(optarg); break;
+			case 'B': bindir = optarg; break;
+			case 'o': output = optarg; break;
+			case 'R': refdir = optarg; break;
+
+			case 's':
+				if(not config::parse_size(optarg, &corpus_sz)) {
+					std::cerr << "bad size: " << optarg << std::endl;
+					return -1;
+				}
+				break;
+
+			case 'p':
+				if(not config::parse_number(optarg, SIZE_MAX, &n)) {
+					std::cerr << "bad count: " << optarg << std::endl;
+					return -1;
+				}
+				properties = n;
+				break;
+
+			case 'S':
+				if(not config::parse_number(optarg, UINT64_MAX, &n)) {
+					std::cerr << "bad seed: " << optarg << std::endl;
+					return -1;
+				}
+				seed = n;
+				break;
+
+			case 'T':
+				if(not config::parse_number(optarg, UINT_MAX, &n)) {
+					std::cerr << "bad time limit: " << optarg << std::endl;
+					return -1;
+				}
+				time_limit = n;
+				limited = true;
+				break;
+
+			case 'L': {
+				std::stringstream ss(optarg);
+				std::string level;
+				levels.clear();
+				while(std::getline(ss, level, ',')) {
+					if(not config::parse_number(level.c_str(), 9, &n)) {
+						std::cerr << "bad level: " << level << std::endl;
+						return -1;
+					}
+					levels.push_back(n);
+				}
+				if(levels.empty()) {
+					std::cerr << "bad levels: " << optarg << std::endl;
+					return -1;
+				}
+				break;
+			}
+
+			default:
+				std::cerr << "Try `" << *argv << " -h' for more information." << std::endl;
+				return -1;
+		}
+	}
+
+	if(bindir.empty()) {
+		std::string self(*argv);
+		bindir = dirname(&self[0]);
+	}
+
+	char tmpl[] = "/tmp/pzbench.XXXXXX";
+
+	if(mkdtemp(tmpl) == nullptr) {
+		std::cerr << "mkdtemp: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	const std::string tmpdir(tmpl);
+
+	std::ofstream file;
+
+	if(not output.empty())
+		file.open(output);
+
+	std::ostream& os = output.empty() ? std::cout : file;
+
+	if(properties > 0) {
+
+		std::list<failure> failures;
+
+		if(not limited)
+			time_limit = 60;
+
+		const std::string input = tmpdir + "/input";
+
+		pz_dictionary shared;
+
+		const bool messages = only.empty() or std::find(only.begin(), only.end(), "message") != only.end();
+
+		if(messages and not train_messages(bindir, tmpdir, shared)) {
+			std::cerr << "message: cannot train a dictionary with " << bindir << "/pzip" << std::endl;
+			return 1;
+		}
+
+		if(messages) {
+
+			const std::string rules = tmpdir + "/rules";
+			const auto failed = check_message_rules(rules);
+
+			for(const auto& what : failed) {
+				failures.push_back({ "message", 0, 0, what, rules });
+				std::cerr << "message rules : " << what << std::endl;
+			}
+
+			if(failed.empty())
+				unlink(rules.c_str());
+		}
+
+		if(only.empty() or std::find(only.begin(), only.end(), "pzip") != only.end()) {
+
+			const std::string large = tmpdir + "/large";
+			const auto failed = check_memory(bindir + "/pzip", large, tmpdir);
+
+			for(const auto& what : failed) {
+				failures.push_back({ "pzip", 2, 0, what, large });
+				std::cerr << "pzip --memory : " << what << std::endl;
+			}
+
+			if(failed.empty())
+				unlink(large.c_str());
+		}
+
+		for(uint64_t n = seed; n < seed + properties; n++) {
+
+			const std::string s = corpus_property(n, corpus_sz);
+
+			std::ofstream(input, std::ios::binary) << s;
+
+			if(messages) {
+				for(const auto& what : check_messages(shared, s)) {
+
+					const std::string kept = tmpdir + "/" + std::to_string(n);
+
+					if(access(kept.c_str(), F_OK) != 0)
+						std::ofstream(kept, std::ios::binary) << s;
+
+					failures.push_back({ "message", 0, n, what, kept });
+
+					std::cerr << "message seed " << n << " : " << what << std::endl;
+				}
+			}
+
+			for(const auto& c : codecs) {
+
+				if(not only.empty() and std::find(only.begin(), only.end(), c.name) == only.end())
+					continue;
+
+				const std::string tool = bindir + "/" + c.name;
+				const std::string reference = refdir.empty() ? "" : refdir + "/" + c.name;
+
+				for(size_t level : (c.leveled ? levels : std::list<size_t>{ 0 })) {
+
+					auto args = c.compress;
+					if(c.leveled)
+						args.push_back("-" + std::to_string(level));
+
+					for(const auto& what : check(c, tool, reference, args, input, tmpdir)) {
+
+						const std::string kept = tmpdir + "/" + std::to_string(n);
+
+						if(access(kept.c_str(), F_OK) != 0)
+							std::ofstream(kept, std::ios::binary) << corpus_property(n, corpus_sz);
+
+						failures.push_back({ c.name, level, n, what, kept });
+
+						std::cerr << c.name << " -" << level << " seed " << n << " : " << what << std::endl;
+					}
+				}
+			}
+		}
+
+		for(const char *name : { "input", "packed", "unpacked", "refpacked", "twice", "doubled" })
+			unlink((tmpdir + "/" + name).c_str());
+
+		for(const auto& x : failures)
+			os << x.codec << " -" << x.level << " seed " << x.seed << " : " << x.what << " : " << x.input << std::endl;
+
+		os << properties << " inputs, " << failures.size() << " failures" << std::endl;
+
+		if(failures.empty())
+			rmdir(tmpdir.c_str());
+
+		return failures.empty() ? 0 : 1;
+	}
+
+	std::list<std::pair<std::string, std::string>> corpora;
+
+	if(optind < argc) {
+
+		for(int i = optind; i < argc; i++) {
+			std::string name(argv[i]);
+			corpora.emplace_back(basename(&name[0]), argv[i]);
+		}
+
+	} else {
+
+		for(const auto& g : generators) {
+			std::string path = tmpdir + "/" + g.first;
+			std::ofstream(path, std::ios::binary) << g.second(corpus_sz);
+			corpora.emplace_back(g.first, path);
+		}
+	}
+
+	const std::string packed = tmpdir + "/packed";
+	const std::string unpacked = tmpdir + "/unpacked";
+	const std::string stats = tmpdir + "/stats";
+
+	std::list<result> results;
+
+	for(const auto& c : codecs) {
+
+		if(not only.empty() and std::find(only.begin(), only.end(), c.name) == only.end())
+			continue;
+
+		const std::string tool = bindir + "/" + c.name;
+
+		for(size_t level : (c.leveled ? levels : std::list<size_t>{ 0 })) {
+
+			for(const auto& corpus : corpora) {
+
+				struct stat sb;
+
+				result x;
+
+				x.corpus = corpus.first;
+				x.codec = c.name;
+				x.level = level;
+				x.input = (stat(corpus.second.c_str(), &sb) == 0) ? sb.st_size : 0;
+
+				auto args = c.compress;
+				if(c.leveled)
+					args.push_back("-" + std::to_string(level));
+				args.push_back("--stats=" + stats);
+
+				auto unpack = c.decompress;
+				unpack.push_back("--stats=" + stats);
+
+				std::cerr << c.name << " -" << level << ' ' << corpus.first << std::flush;
+
+				x.compress = execute(tool, args, corpus.second, packed);
+				x.compress.phases = read_phases(stats);
+				x.decompressed = x.compress.ok and not c.decompress.empty();
+				x.roundtrip = false;
+
+				if(x.decompressed) {
+					x.decompress = execute(tool, unpack, packed, unpacked);
+					x.decompress.phases = read_phases(stats);
+					x.roundtrip = x.decompress.ok and same_file(corpus.second, unpacked);
+				}
+
+				unlink(stats.c_str());
+
+				std::cerr << " : " << x.compress.seconds << 's' << std::endl;
+
+				results.push_back(x);
+			}
+		}
+	}
+
+	for(const auto& corpus : corpora)
+		if(corpus.second.compare(0, tmpdir.size(), tmpdir) == 0)
+			unlink(corpus.second.c_str());
+
+	unlink(packed.c_str());
+	unlink(unpacked.c_str());
+	rmdir(tmpdir.c_str());
+
+	if(json)
+		print_json(os, results);
+	else
+		print_csv(os, results);
+
+	return 0;
+}
@@ -1,8 +1,17 @@
 #include <sstream>
 #include <iostream>
 
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
 extern "C" {
 #include <unistd.h>
+#include <getopt.h>
 }
 
 #include <config.hh>
@@ -15,6 +24,16 @@ void config::usage(const char *prog) const {
 		return ss.str();
 	};
 
+	auto only = [this](unsigned opt, const std::string& text) -> std::string {
+		return (takes & opt) ? text : std::string();
+	};
+
+	auto long_option = [](const char *name, const char *msg) -> std::string {
+		std::stringstream ss;
+		ss << '\t' << "--" << name << '\t' << msg << std::endl;
+		return ss.str();
+	};
+
 	std::cerr << prog << " file compressor." << std::endl << std::endl <<
 
 		"usage: " << prog << " [{option|file}]..." << std::endl << std::endl <<
@@ -31,19 +50,161 @@ void config::usage(const char *prog) const {
 		option('1',"fastest compression") <<
 		option('9',"best compression") <<
 		option('v',"be verbose") <<
+		only(opt_window, option('b',"size\twindow size of streamed input (K/M/G suffixes)")) <<
+		only(opt_window, option('l',"msec\tlatency before a partial window is flushed")) <<
+		only(opt_jobs, option('j',"n\tprocess n files at once (n >= 1)")) <<
+		only(opt_dictionary, option('D',"dict\tcontinue from the rules of a dictionary made by --train")) <<
+		only(opt_stats, long_option("stats=file","write per phase and per round statistics to file as json")) <<
+		only(opt_verify, long_option("verify","expand each block after compressing it and compare with the input")) <<
+		only(opt_direct, long_option("direct","write output with O_DIRECT where possible, bypassing the page cache")) <<
+		only(opt_dictionary, long_option("train=dict","induce rules from the files together and write them to dict")) <<
+		only(opt_memory, long_option("memory=size","induce regular files larger than size out of core, in frames that compress and decompress in about that much memory (8M at least)")) <<
+		only(opt_sketch, long_option("sketch=size","pick the pairs to count from a sketch of size bytes while they are too many to count")) <<
+		only(opt_sort, long_option("sort","count pairs by sorting them instead of hashing")) <<
+
+		std::endl;
+
+	if(takes & opt_profiles)
+		std::cerr <<
+
+			"Levels 1-9 replace, each round, the n-grams of up to L symbols seen at" << std::endl <<
+			"least M times, for at most R rounds (- runs until nothing repeats):" << std::endl << std::endl <<
+
+			"\t-1 L2 M16 R2\t-2 L2 M12 R4\t-3 L2 M10 R-" << std::endl <<
+			"\t-4 L3 M9 R-\t-5 to -9 L3 M9 R-, and 1 to 5 alternatives" << std::endl <<
+
+			std::endl <<
+
+			"Repeats of 4 or more symbols seen M times become rules before the first round." << std::endl <<
+			"From -4 on, rounds then go on with pairs of symbols up to L-1 apart, the bytes" << std::endl <<
+			"between them left as arguments of a gapped rule. From -5 on each block is" << std::endl <<
+			"induced again with another threshold and repeat length, keeping the smallest" << std::endl <<
+			"result. -5 adds M10 with repeats of 8, and each level up adds one more: M10" << std::endl <<
+			"and 3, M8 and 4, M10 and no repeats, M10 and 2. A level is slower than the" << std::endl <<
+			"one below it, but never compresses worse." << std::endl <<
+
+			std::endl;
+
+	std::cerr << "If no file names are given, " << prog << " uses stdin/stdout." << std::endl << std::endl;
+}
+
+bool config::parse_number(const char *s, unsigned long long max, unsigned long long *n, const char **end) {
+
+	// digits only, strtoull would take a sign or spaces, up to max
+
+	if(not isdigit((unsigned char)*s))
+		return false;
+
+	char *e;
+
+	errno = 0;
 
-		std::endl <<
+	*n = strtoull(s, &e, 10);
 
-		"If no file names are given, " << prog << " uses stdin/stdout." << std::endl << std::endl;
+	if(errno == ERANGE or *n > max)
+		return false;
+
+	if(end != nullptr)
+		*end = e;
+	else if(*e != '\0')
+		return false;
+
+	return true;
+}
+
+bool config::parse_size(const char *s, size_t *sz) {
+
+	unsigned long long n;
+	const char *end;
+
+	if(not parse_number(s, SIZE_MAX, &n, &end))
+		return false;
+
+	size_t shift = 0;
+
+	switch(toupper((unsigned char)*end)) {
+		case 'G': shift += 10; // fall through
+		case 'M': shift += 10; // fall through
+		case 'K': shift += 10; end++;
+	}
+
+	if(*end != '\0' or n > (SIZE_MAX >> shift))
+		return false;
+
+	*sz = n << shift;
+
+	return true;
 }
 
 bool config::getopt(int argc, char **argv) {
 
+	enum { stats_option = 256, verify_option, direct_option, train_option, memory_option, sketch_option, sort_option };
+
+	const static struct { unsigned opt; struct option option; } all[] = {
+		{ opt_stats,      { "stats",  required_argument, nullptr, stats_option  } },
+		{ opt_verify,     { "verify", no_argument,       nullptr, verify_option } },
+		{ opt_direct,     { "direct", no_argument,       nullptr, direct_option } },
+		{ opt_dictionary, { "train",  required_argument, nullptr, train_option  } },
+		{ opt_memory,     { "memory", required_argument, nullptr, memory_option } },
+		{ opt_sketch,     { "sketch", required_argument, nullptr, sketch_option } },
+		{ opt_sort,       { "sort",   no_argument,       nullptr, sort_option   } }
+	};
+
+	// only what the tool takes, getopt_long then refuses the rest itself
+
+	std::vector<struct option> options;
+
+	for(const auto& o : all)
+		if(takes & o.opt)
+			options.push_back(o.option);
+
+	options.push_back({ nullptr, 0, nullptr, 0 });
+
+	std::string shorts = "hdzkfcqv0123456789";
+
+	if(takes & opt_window)
+		shorts += "b:l:";
+	if(takes & opt_jobs)
+		shorts += "j:";
+	if(takes & opt_dictionary)
+		shorts += "D:";
+
 	int opt;
+	unsigned long long n;
+
+	while ((opt = ::getopt_long(argc, argv, shorts.c_str(), options.data(), nullptr)) != -1) {
+
+		if(opt == stats_option) {
+
+			statsfile = optarg;
 
-	while ((opt = ::getopt(argc, argv, "hdzkfcqv0123456789")) != -1) {
+		} else if(opt == verify_option) {
 
-		if(isdigit(opt)) {
+			verify = true;
+
+		} else if(opt == direct_option) {
+
+			direct = true;
+
+		} else if(opt == train_option) {
+
+			train = optarg;
+
+		} else if(opt == memory_option) {
+
+			if(not parse_size(optarg, &memory))
+				return false;
+
+		} else if(opt == sketch_option) {
+
+			if(not parse_size(optarg, &sketch))
+				return false;
+
+		} else if(opt == sort_option) {
+
+			sort = true;
+
+		} else if(isdigit(opt)) {
 
 			level = opt - '0';
 
@@ -58,6 +219,27 @@ bool config::getopt(int argc, char **argv) {
 			case 'q': quiet     = true  ; break;
 			case 'v': verbose   = true  ; break;
 
+			case 'b':
+				if(not parse_size(optarg, &window))
+					return false;
+				break;
+
+			case 'l':
+				if(not parse_number(optarg, INT_MAX, &n))
+					return false;
+				latency = n;
+				break;
+
+			case 'D':
+				dictfile = optarg;
+				break;
+
+			case 'j':
+				if(not parse_number(optarg, SIZE_MAX, &n) or n < 1)
+					return false;
+				jobs = n;
+				break;
+
 			default : return false;
 		}
 	}
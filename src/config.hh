@@ -2,6 +2,15 @@
 
 #include <list>
 #include <string>
+#include <ostream>
+#include <iostream>
+
+extern "C" {
+#include <unistd.h>
+}
+
+struct pz_stats;
+struct pz_dictionary;
 
 struct config {
 
@@ -11,12 +20,54 @@ struct config {
     bool quiet     = false;
     bool verbose   = false;
     bool stdoutput = false;
+    bool verify    = false;
+    bool direct    = false;
+    bool sort      = false;
 
     bool compress  = true;
 
 	size_t level = 2;
 
+	size_t window  = 0;
+	int    latency = 1000;
+
+	size_t jobs = 1;
+
+	size_t memory = 0;
+	size_t sketch = 0;
+
+	std::ostream *log = &std::cerr;
+	int output = STDOUT_FILENO;
+
+	std::string statsfile;
+	pz_stats *stats = nullptr;
+
+	std::string train;
+	std::string dictfile;
+	const pz_dictionary *dictionary = nullptr;
+
+	// the options a tool takes besides the common ones. getopt() refuses
+	// the others and usage() lists only these
+	enum : unsigned {
+		opt_window     = 1 << 0, // -b, -l
+		opt_jobs       = 1 << 1, // -j
+		opt_dictionary = 1 << 2, // -D, --train
+		opt_stats      = 1 << 3,
+		opt_verify     = 1 << 4,
+		opt_direct     = 1 << 5,
+		opt_memory     = 1 << 6,
+		opt_sketch     = 1 << 7,
+		opt_sort       = 1 << 8,
+		opt_profiles   = 1 << 9, // usage() describes pzip's level profiles
+		opt_all        = (1 << 10) - 1
+	};
+
+	unsigned takes = opt_all;
+
     std::list<std::string> files;
     void usage(const char *) const;
     bool getopt(int, char **);
+
+    static bool parse_number(const char *, unsigned long long, unsigned long long *, const char ** = nullptr);
+    static bool parse_size(const char *, size_t *);
 };
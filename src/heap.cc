@@ -0,0 +1,76 @@
+#include <new>
+#include <atomic>
+
+#include <cstdlib>
+
+extern "C" {
+#include <malloc.h>
+}
+
+#include <heap.hh>
+
+static std::atomic<bool> heap_tracking(false);
+static std::atomic<long> heap_live(0);
+static std::atomic<long> heap_peak(0);
+static thread_local size_t heap_allocated = 0;
+
+void pz_heap::track(bool on) {
+	heap_tracking = on;
+}
+
+size_t pz_heap::allocated() {
+	return heap_allocated;
+}
+
+size_t pz_heap::peak() {
+	return heap_peak;
+}
+
+void *operator new(size_t sz) {
+
+	void *p = malloc(sz == 0 ? 1 : sz);
+
+	if(p == nullptr)
+		throw std::bad_alloc();
+
+	if(heap_tracking.load(std::memory_order_relaxed)) {
+
+		long n = malloc_usable_size(p);
+		long live = heap_live.fetch_add(n, std::memory_order_relaxed) + n;
+		long peak = heap_peak.load(std::memory_order_relaxed);
+
+		heap_allocated += n;
+
+		while(live > peak and not heap_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+			;
+	}
+
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+
+	if(p != nullptr and heap_tracking.load(std::memory_order_relaxed))
+		heap_live.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	operator delete(p);
+}
+
+// the nothrow forms, used by std::stable_sort among others, must pair with
+// the replaced operator delete as well
+
+void *operator new(size_t sz, const std::nothrow_t&) noexcept {
+	try {
+		return operator new(sz);
+	} catch(const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept {
+	operator delete(p);
+}
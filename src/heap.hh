@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+//
+// pz_heap
+//
+// the tools replace the global operator new/delete with heap.o, which libpz
+// does not link in. while tracking is on they count the bytes allocated by
+// each thread and the peak of live heap bytes.
+//
+
+struct pz_heap {
+	static void track(bool);
+	static size_t allocated();
+	static size_t peak();
+};
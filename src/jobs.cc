@@ -0,0 +1,161 @@
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+extern "C" {
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+}
+
+#include <jobs.hh>
+
+struct job {
+	std::string file;
+	off_t size = 0;
+	std::ostringstream log;
+	FILE *output = nullptr;
+	bool done = false;
+	bool ok = false;
+};
+
+static bool copy_fd(int fdin, int fdout) {
+
+	char buf[1 << 16];
+	ssize_t n;
+
+	while((n = read(fdin, buf, sizeof(buf))) != 0) {
+
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+
+		for(ssize_t done = 0, m; done < n; done += m)
+			if((m = write(fdout, buf + done, n - done)) == -1)
+				return false;
+	}
+
+	return true;
+}
+
+//
+// files are handed to cfg.jobs workers largest first, so the longest job starts
+// earliest. each job runs on its own copy of cfg that logs into a string and,
+// when writing to standard output, into a temporary file. both are released in
+// command line order as soon as every file before them has finished.
+//
+
+bool run_jobs(const config& cfg, job_function f) {
+
+	std::vector<job> jobs(cfg.files.size());
+	std::vector<size_t> order(jobs.size());
+
+	size_t i = 0;
+
+	for(const auto& file : cfg.files) {
+
+		struct stat sb;
+
+		jobs[i].file = file;
+
+		if(lstat(file.c_str(), &sb) == 0)
+			jobs[i].size = sb.st_size;
+
+		order[i] = i;
+		i++;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) {
+		return jobs[a].size > jobs[b].size;
+	});
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::atomic<size_t> next(0);
+
+	config base = cfg;
+
+	base.files.clear();
+	base.jobs = 1;
+
+	auto worker = [&]() {
+
+		size_t n;
+
+		while((n = next++) < order.size()) {
+
+			job& j = jobs[order[n]];
+
+			config c = base;
+
+			c.log = &j.log;
+
+			bool ok = false;
+
+			if(cfg.stdoutput and (j.output = tmpfile()) == nullptr) {
+
+				j.log << j.file << ": " << strerror(errno) << std::endl;
+
+			} else {
+
+				if(j.output != nullptr)
+					c.output = fileno(j.output);
+
+				try {
+					ok = f(c, j.file.c_str());
+				} catch(const std::exception& e) {
+					j.log << e.what() << std::endl;
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(m);
+
+			j.done = true;
+			j.ok = ok;
+
+			cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> workers;
+
+	for(size_t n = 0; n < std::min(cfg.jobs, jobs.size()); n++)
+		workers.emplace_back(worker);
+
+	bool ok = true;
+
+	for(auto& j : jobs) {
+
+		{
+			std::unique_lock<std::mutex> lock(m);
+			cv.wait(lock, [&j] { return j.done; });
+		}
+
+		*cfg.log << j.log.str() << std::flush;
+
+		if(j.output != nullptr) {
+			if(lseek(fileno(j.output), 0, SEEK_SET) == -1 or not copy_fd(fileno(j.output), cfg.output)) {
+				*cfg.log << j.file << ": " << strerror(errno) << std::endl;
+				j.ok = false;
+			}
+			fclose(j.output);
+		}
+
+		ok = ok and j.ok;
+	}
+
+	for(auto& t : workers)
+		t.join();
+
+	return ok;
+}
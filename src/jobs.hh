@@ -0,0 +1,7 @@
+#pragma once
+
+#include <config.hh>
+
+using job_function = bool (*)(const config&, const char *);
+
+bool run_jobs(const config&, job_function);
@@ -1 +1,1433 @@
+#include <new>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <functional>
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+}
+
 #include <libpz.hh>
+
+//
+// pz_crc32c
+//
+
+// the sse4.2 crc32 instruction is used when the cpu has it, chosen once at
+// startup. otherwise a slicing-by-8 table walk handles 8 bytes per step.
+//
+
+static constexpr uint32_t crc32c_poly = 0x82f63b78;
+
+static const struct crc32c_table {
+
+	uint32_t t[8][256];
+
+	crc32c_table() {
+
+		for(uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for(int k = 0; k < 8; k++)
+				c = (c >> 1) ^ (crc32c_poly & (0 - (c & 1)));
+			t[0][n] = c;
+		}
+
+		for(uint32_t n = 0; n < 256; n++)
+			for(int k = 1; k < 8; k++)
+				t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+	}
+
+} crc32c;
+
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *q, size_t sz) {
+
+	while(sz > 0 and ((uintptr_t)q & 7) != 0) {
+		crc = crc32c.t[0][(crc ^ *q++) & 0xff] ^ (crc >> 8);
+		sz--;
+	}
+
+	while(sz >= 8) {
+
+		uint32_t lo;
+		uint32_t hi;
+
+		memcpy(&lo, q, 4);
+		memcpy(&hi, q + 4, 4);
+
+		lo ^= crc;
+
+		crc = crc32c.t[7][lo & 0xff] ^ crc32c.t[6][(lo >> 8) & 0xff] ^
+		      crc32c.t[5][(lo >> 16) & 0xff] ^ crc32c.t[4][lo >> 24] ^
+		      crc32c.t[3][hi & 0xff] ^ crc32c.t[2][(hi >> 8) & 0xff] ^
+		      crc32c.t[1][(hi >> 16) & 0xff] ^ crc32c.t[0][hi >> 24];
+
+		q += 8;
+		sz -= 8;
+	}
+
+	while(sz-- > 0)
+		crc = crc32c.t[0][(crc ^ *q++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *q, size_t sz) {
+
+	uint64_t c = crc;
+
+	while(sz > 0 and ((uintptr_t)q & 7) != 0) {
+		c = __builtin_ia32_crc32qi(c, *q++);
+		sz--;
+	}
+
+	while(sz >= 8) {
+		uint64_t x;
+		memcpy(&x, q, 8);
+		c = __builtin_ia32_crc32di(c, x);
+		q += 8;
+		sz -= 8;
+	}
+
+	while(sz-- > 0)
+		c = __builtin_ia32_crc32qi(c, *q++);
+
+	return c;
+}
+
+static uint32_t (*const crc32c_update)(uint32_t, const uint8_t *, size_t) =
+	__builtin_cpu_supports("sse4.2") ? crc32c_sse42 : crc32c_portable;
+
+#else
+
+static uint32_t (*const crc32c_update)(uint32_t, const uint8_t *, size_t) = crc32c_portable;
+
+#endif
+
+uint32_t pz_crc32c(uint32_t crc, const void *p, size_t sz) {
+	return ~crc32c_update(~crc, (const uint8_t *)p, sz);
+}
+
+//
+// crc(a + b) from crc(a), crc(b) and the length of b, by applying len2 zero
+// bytes to crc1 as powers of the crc shift operator over gf(2), as zlib does.
+//
+
+static uint32_t gf2_times(const uint32_t *m, uint32_t v) {
+
+	uint32_t x = 0;
+
+	for(int n = 0; v != 0; n++, v >>= 1)
+		if(v & 1)
+			x ^= m[n];
+
+	return x;
+}
+
+static void gf2_square(uint32_t *sq, const uint32_t *m) {
+	for(int n = 0; n < 32; n++)
+		sq[n] = gf2_times(m, m[n]);
+}
+
+uint32_t pz_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	if(len2 == 0)
+		return crc1;
+
+	// odd is the operator for one zero bit, even for two, then four
+
+	odd[0] = crc32c_poly;
+
+	for(int n = 1; n < 32; n++)
+		odd[n] = 1u << (n - 1);
+
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+
+	do {
+
+		gf2_square(even, odd);
+
+		if(len2 & 1)
+			crc1 = gf2_times(even, crc1);
+
+		if((len2 >>= 1) == 0)
+			break;
+
+		gf2_square(odd, even);
+
+		if(len2 & 1)
+			crc1 = gf2_times(odd, crc1);
+
+		len2 >>= 1;
+
+	} while(len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+//
+// pz_clock
+//
+
+pz_clock pz_clock::now() {
+
+	struct timespec w;
+	struct timespec c;
+
+	clock_gettime(CLOCK_MONOTONIC, &w);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c);
+
+	pz_clock x;
+
+	x.wall = w.tv_sec + w.tv_nsec / 1e9;
+	x.cpu = c.tv_sec + c.tv_nsec / 1e9;
+
+	return x;
+}
+
+//
+// pz_stats
+//
+
+pz_stats::pz_stats(const std::string& name) : tool(name) {
+}
+
+void pz_stats::add(const std::string& name, pz_block_stats&& b) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	pz_source_stats *& source = index[name];
+
+	if(source == nullptr) {
+		sources.emplace_back();
+		source = &sources.back();
+		source->name = name;
+	}
+
+	source->blocks.push_back(std::move(b));
+}
+
+static std::ostream& operator<<(std::ostream& os, const pz_clock& x) {
+	return os << "{ \"wall\": " << x.wall << ", \"cpu\": " << x.cpu << " }";
+}
+
+static std::ostream& operator<<(std::ostream& os, const std::map<size_t,size_t>& x) {
+
+	os << '{';
+
+	for(auto iter = x.begin(); iter != x.end(); iter++)
+		os << (iter == x.begin() ? " " : ", ") << '"' << iter->first << "\": " << iter->second;
+
+	return os << " }";
+}
+
+void pz_stats::write(std::ostream& os) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	os << std::setprecision(6) << std::fixed;
+
+	os << "{" << std::endl;
+	os << "  \"tool\": \"" << tool << "\"," << std::endl;
+	os << "  \"peak_heap_bytes\": " << peak_heap << "," << std::endl;
+	os << "  \"peak_rss_kb\": " << ru.ru_maxrss << "," << std::endl;
+	os << "  \"sources\": [" << std::endl;
+
+	for(auto s = sources.begin(); s != sources.end(); s++) {
+
+		os << "    { \"name\": \"";
+
+		for(char ch : s->name) {
+			if(ch == '"' or ch == '\\')
+				os << '\\';
+			os << ch;
+		}
+
+		os << "\", \"blocks\": [" << std::endl;
+
+		for(auto b = s->blocks.begin(); b != s->blocks.end(); b++) {
+
+			os << "      { ";
+
+			if(not b->mode.empty())
+				os << "\"mode\": \"" << b->mode << "\", ";
+
+			os << "\"input\": " << b->input << ", \"output\": " << b->output << ", \"time\": " << b->time << "," << std::endl;
+			os << "        \"phases\": {";
+
+			for(auto p = b->phases.begin(); p != b->phases.end(); p++)
+				os << (p == b->phases.begin() ? " " : ", ") << '"' << p->first << "\": " << p->second;
+
+			os << " }," << std::endl;
+			os << "        \"rule_lengths\": " << b->rule_lengths << "," << std::endl;
+			os << "        \"expansion_lengths\": " << b->expansion_lengths << "," << std::endl;
+			os << "        \"rounds\": [" << std::endl;
+
+			for(auto r = b->rounds.begin(); r != b->rounds.end(); r++) {
+				os << "          { \"round\": " << r->round << ", \"time\": " << r->time;
+				os << ", \"histogram\": " << r->histogram << ", \"candidates\": " << r->candidates;
+				os << ", \"replacements\": " << r->replacements << ", \"created\": " << r->created;
+				os << ", \"inlined\": " << r->inlined << ", \"symbols\": " << r->symbols;
+				os << ", \"rules\": " << r->rules << ", \"allocated\": " << r->allocated << " }";
+				os << (std::next(r) == b->rounds.end() ? "" : ",") << std::endl;
+			}
+
+			os << "        ] }" << (std::next(b) == s->blocks.end() ? "" : ",") << std::endl;
+		}
+
+		os << "    ] }" << (std::next(s) == sources.end() ? "" : ",") << std::endl;
+	}
+
+	os << "  ]" << std::endl;
+	os << "}" << std::endl;
+}
+
+bool pz_stats::write(const std::string& filename) {
+
+	std::ofstream os(filename);
+
+	if(not os)
+		return false;
+
+	write(os);
+
+	return bool(os);
+}
+
+//
+// pz_writer
+//
+
+constexpr size_t pz_writer::default_capacity;
+constexpr size_t pz_writer::alignment;
+
+pz_writer::pz_writer(int f, bool d, size_t sz) : fd(f), direct(d), capacity(sz) {
+
+	capacity = std::max<size_t>(alignment, capacity - capacity % alignment);
+
+	void *p;
+
+	if(posix_memalign(&p, alignment, capacity) != 0)
+		throw std::bad_alloc();
+
+	buffer = (char *)p;
+
+	// O_DIRECT needs an aligned file offset as well as aligned memory,
+	// and is refused outright by pipes and some file systems
+
+	if(direct) {
+
+		int flags = fcntl(fd, F_GETFL);
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+
+		direct = flags != -1 and offset != -1 and offset % alignment == 0 and fcntl(fd, F_SETFL, flags | O_DIRECT) != -1;
+	}
+}
+
+pz_writer::~pz_writer() {
+
+	try {
+		flush();
+	} catch(const std::exception&) {
+	}
+
+	undirect();
+
+	free(buffer);
+}
+
+void pz_writer::undirect() {
+
+	if(direct) {
+		int flags = fcntl(fd, F_GETFL);
+		if(flags != -1)
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+		direct = false;
+	}
+}
+
+void pz_writer::drain(const struct iovec *v, int n) {
+
+	struct iovec iov[2];
+
+	std::copy(v, v + n, iov);
+
+	struct iovec *p = iov;
+
+	while(n > 0) {
+
+		ssize_t m = writev(fd, p, n);
+
+		if(m == -1) {
+			if(errno == EINTR or errno == EAGAIN)
+				continue;
+			if(errno == EINVAL and direct) {
+				undirect();
+				continue;
+			}
+			throw std::runtime_error("write() failed");
+		}
+
+		total += m;
+
+		while(n > 0 and (size_t)m >= p->iov_len) {
+			m -= p->iov_len;
+			p++;
+			n--;
+		}
+
+		if(n > 0) {
+			p->iov_base = (char *)p->iov_base + m;
+			p->iov_len -= m;
+		}
+	}
+}
+
+void pz_writer::overflow(const void *p, size_t sz) {
+
+	const char *q = (const char *)p;
+
+	// unaligned user memory cannot go out with O_DIRECT, so in that
+	// case everything is copied through the buffer
+
+	if(sz >= capacity and not direct) {
+		struct iovec v[2] = { { buffer, used }, { (void *)q, sz } };
+		drain(used > 0 ? v : v + 1, used > 0 ? 2 : 1);
+		used = 0;
+		return;
+	}
+
+	while(sz > 0) {
+
+		size_t n = std::min(sz, capacity - used);
+
+		memcpy(buffer + used, q, n);
+
+		used += n;
+		q += n;
+		sz -= n;
+
+		if(used == capacity) {
+			struct iovec v = { buffer, used };
+			drain(&v, 1);
+			used = 0;
+		}
+	}
+}
+
+void pz_writer::flush() {
+
+	if(used == 0)
+		return;
+
+	size_t head = direct ? used - used % alignment : used;
+
+	if(head > 0) {
+		struct iovec v = { buffer, head };
+		drain(&v, 1);
+	}
+
+	if(head < used) {
+
+		// the tail leaves the file offset unaligned,
+		// so the rest of the output is buffered io
+
+		undirect();
+
+		struct iovec v = { buffer + head, used - head };
+		drain(&v, 1);
+	}
+
+	used = 0;
+}
+
+void pz_writer::copy(int from, off_t offset, size_t sz) {
+
+	// each method is tried in turn and, once refused for this pair of
+	// descriptors, not tried again. the last resort is pread() and write()
+
+	enum { by_copy_file_range, by_splice, by_sendfile, by_pread } method = by_copy_file_range;
+
+	flush();
+	undirect();
+
+	while(sz > 0) {
+
+		ssize_t n = -1;
+		loff_t off = offset;
+
+		switch(method) {
+
+			case by_copy_file_range:
+				n = copy_file_range(from, &off, fd, nullptr, sz, 0);
+				break;
+
+			case by_splice:
+				n = splice(from, &off, fd, nullptr, sz, SPLICE_F_MOVE);
+				break;
+
+			case by_sendfile:
+				n = sendfile(fd, from, &offset, sz);
+				off = offset;
+				break;
+
+			case by_pread:
+				n = pread(from, buffer, std::min(sz, capacity), offset);
+				if(n > 0) {
+					struct iovec v = { buffer, (size_t)n };
+					drain(&v, 1);
+					total -= n;
+					off = offset + n;
+				}
+				break;
+		}
+
+		if(n == -1) {
+
+			if(errno == EINTR or errno == EAGAIN)
+				continue;
+
+			if(method != by_pread and (errno == EINVAL or errno == EXDEV or errno == ENOSYS or errno == EOPNOTSUPP or errno == EBADF)) {
+				method = decltype(method)(method + 1);
+				continue;
+			}
+
+			throw std::runtime_error("copy failed");
+		}
+
+		if(n == 0)
+			throw std::runtime_error("unexpected end of input");
+
+		offset = off;
+		total += n;
+		sz -= n;
+	}
+}
+
+//
+// pz_suffix_array
+//
+
+std::vector<int32_t> pz_suffix_array(const std::vector<int32_t>& s, int32_t alphabet) {
+
+	const size_t n = s.size();
+
+	std::vector<int32_t> sa(n);
+	std::vector<int32_t> rank(s);
+	std::vector<int32_t> tmp(n);
+	std::vector<size_t> count(std::max<size_t>(alphabet, n) + 1);
+
+	if(n == 0)
+		return sa;
+
+	// stable counting sort of the suffixes in tmp by their rank into sa
+
+	auto sort = [&](size_t classes) {
+
+		std::fill(count.begin(), count.begin() + classes + 1, 0);
+
+		for(size_t i = 0; i < n; i++)
+			count[rank[i] + 1]++;
+
+		for(size_t i = 1; i <= classes; i++)
+			count[i] += count[i - 1];
+
+		for(size_t i = 0; i < n; i++)
+			sa[count[rank[tmp[i]]]++] = tmp[i];
+	};
+
+	for(size_t i = 0; i < n; i++)
+		tmp[i] = i;
+
+	sort(alphabet);
+
+	size_t classes = alphabet;
+
+	for(size_t k = 1; ; k <<= 1) {
+
+		// sa holds the suffixes ordered by their first k symbols, so ordering
+		// by the second half first and stably by the first gives 2k symbols
+
+		size_t p = 0;
+
+		for(size_t i = n - std::min(k, n); i < n; i++)
+			tmp[p++] = i;
+
+		for(size_t i = 0; i < n; i++)
+			if((size_t)sa[i] >= k)
+				tmp[p++] = sa[i] - k;
+
+		sort(classes);
+
+		auto second = [&](size_t i) -> int32_t {
+			return i + k < n ? rank[i + k] : -1;
+		};
+
+		tmp[sa[0]] = 0;
+
+		for(size_t i = 1; i < n; i++) {
+			const size_t a = sa[i - 1];
+			const size_t b = sa[i];
+			tmp[b] = tmp[a] + (rank[a] != rank[b] or second(a) != second(b));
+		}
+
+		classes = tmp[sa[n - 1]] + 1;
+
+		rank.swap(tmp);
+
+		if(classes == n)
+			break;
+	}
+
+	return sa;
+}
+
+std::vector<int32_t> pz_lcp_array(const std::vector<int32_t>& s, const std::vector<int32_t>& sa) {
+
+	const size_t n = s.size();
+
+	std::vector<int32_t> rank(n);
+	std::vector<int32_t> lcp(n, 0);
+
+	for(size_t i = 0; i < n; i++)
+		rank[sa[i]] = i;
+
+	size_t h = 0;
+
+	for(size_t i = 0; i < n; i++) {
+
+		if(rank[i] == 0) {
+			h = 0;
+			continue;
+		}
+
+		const size_t j = sa[rank[i] - 1];
+
+		while(i + h < n and j + h < n and s[i + h] == s[j + h])
+			h++;
+
+		lcp[rank[i]] = h;
+
+		if(h > 0)
+			h--;
+	}
+
+	return lcp;
+}
+
+std::vector<pz_repeat> pz_maximal_repeats(const std::vector<int32_t>& s, int32_t alphabet, size_t minlen, size_t mincount) {
+
+	struct interval {
+		size_t length;
+		size_t lb;
+		size_t rb;
+	};
+
+	const size_t n = s.size();
+
+	std::vector<pz_repeat> repeats;
+
+	if(n < 2 * minlen)
+		return repeats;
+
+	const std::vector<int32_t> sa = pz_suffix_array(s, alphabet);
+	const std::vector<int32_t> lcp = pz_lcp_array(s, sa);
+
+	// the lcp intervals of at least minlen, found bottom up with a stack
+
+	std::vector<interval> intervals;
+	std::vector<interval> stack;
+
+	stack.push_back({ 0, 0, 0 });
+
+	for(size_t i = 1; i <= n; i++) {
+
+		const size_t l = (i < n) ? lcp[i] : 0;
+
+		size_t lb = i - 1;
+
+		while(l < stack.back().length) {
+
+			interval top = stack.back();
+
+			stack.pop_back();
+
+			top.rb = i - 1;
+			lb = top.lb;
+
+			if(top.length >= minlen)
+				intervals.push_back(top);
+		}
+
+		if(l > stack.back().length)
+			stack.push_back({ l, lb, 0 });
+	}
+
+	std::stable_sort(intervals.begin(), intervals.end(), [](const interval& a, const interval& b) {
+		return (a.rb - a.lb + 1) * (a.length - 1) > (b.rb - b.lb + 1) * (b.length - 1);
+	});
+
+	// the symbols examined are counted against a budget, as inputs like
+	// long runs have very many nested intervals
+
+	std::vector<bool> covered(n, false);
+	std::vector<size_t> positions;
+
+	size_t budget = 32 * n;
+
+	for(const interval& x : intervals) {
+
+		const size_t occurrences = x.rb - x.lb + 1;
+
+		if(occurrences < mincount)
+			continue;
+
+		if(occurrences > budget)
+			break;
+
+		budget -= occurrences;
+
+		positions.assign(sa.begin() + x.lb, sa.begin() + x.rb + 1);
+
+		std::sort(positions.begin(), positions.end());
+
+		pz_repeat r;
+
+		r.length = x.length;
+
+		for(size_t p : positions) {
+
+			if(not r.positions.empty() and p < r.positions.back() + r.length)
+				continue;
+
+			auto first = covered.begin() + p;
+			auto last = first + r.length;
+
+			auto hit = std::find(first, last, true);
+
+			budget -= std::min<size_t>(budget, hit - first);
+
+			if(hit == last)
+				r.positions.push_back(p);
+		}
+
+		if(r.positions.size() < std::max<size_t>(mincount, 2))
+			continue;
+
+		for(size_t p : r.positions)
+			std::fill(covered.begin() + p, covered.begin() + p + r.length, true);
+
+		repeats.push_back(std::move(r));
+	}
+
+	return repeats;
+}
+
+//
+// pz_pair_counts
+//
+
+static void pz_count_pairs(const std::vector<int32_t>& s, size_t first, size_t last, size_t gaps, size_t ways, std::vector<uint32_t>& t) {
+
+	constexpr size_t table = 1 << 16;
+
+	// bytes right before first, as far back as a pair can reach
+
+	size_t run = 0;
+
+	while(run < std::min(first, gaps + 1) and s[first - run - 1] >= 0 and s[first - run - 1] < 256)
+		run++;
+
+	for(size_t j = first; j < last; j++) {
+
+		const int32_t y = s[j];
+
+		if(y < 0 or y >= 256) {
+			run = 0;
+			continue;
+		}
+
+		uint32_t *sub = t.data() + (j % ways) * table;
+
+		for(size_t g = 0; g <= gaps and g < run; g++)
+			sub[(g * ways * table) + (s[j - g - 1] << 8 | y)]++;
+
+		run = std::min(run + 1, gaps + 1);
+	}
+}
+
+std::vector<std::vector<uint64_t>> pz_pair_counts(const std::vector<int32_t>& s, size_t gaps, size_t threads) {
+
+	constexpr size_t table = 1 << 16;
+	constexpr size_t chunk = 1 << 20;
+
+	// small inputs are not worth clearing and summing sub-histograms for
+
+	const size_t ways = s.size() < table ? 1 : 4;
+
+	if(threads == 0)
+		threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), s.size() / chunk));
+
+	threads = std::max<size_t>(1, std::min(threads, s.size()));
+
+	// per thread, for each gap, ways sub-histograms side by side
+
+	std::vector<std::vector<uint32_t>> tables(threads, std::vector<uint32_t>((gaps + 1) * ways * table, 0));
+	std::vector<std::thread> workers;
+
+	const size_t step = (s.size() + threads - 1) / threads;
+
+	for(size_t n = 1; n < threads; n++)
+		workers.emplace_back(pz_count_pairs, std::cref(s), std::min(n * step, s.size()), std::min((n + 1) * step, s.size()), gaps, ways, std::ref(tables[n]));
+
+	pz_count_pairs(s, 0, std::min(step, s.size()), gaps, ways, tables[0]);
+
+	for(auto& w : workers)
+		w.join();
+
+	std::vector<std::vector<uint64_t>> counts(gaps + 1, std::vector<uint64_t>(table, 0));
+
+	for(const auto& t : tables)
+		for(size_t g = 0; g <= gaps; g++)
+			for(size_t w = 0; w < ways; w++)
+				for(size_t k = 0; k < table; k++)
+					counts[g][k] += t[(g * ways + w) * table + k];
+
+	return counts;
+}
+
+//
+// pz_sort_pairs
+//
+
+void pz_sort_pairs(std::vector<pz_pair_record>& v, size_t threads) {
+
+	constexpr size_t chunk = 1 << 16;
+	constexpr size_t radix = 256;
+
+	const size_t n = v.size();
+
+	if(threads == 0)
+		threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), n / chunk));
+
+	threads = std::max<size_t>(1, std::min(threads, n));
+
+	const size_t step = (n + threads - 1) / threads;
+
+	std::vector<pz_pair_record> w(n);
+	std::vector<size_t> offsets(threads * radix);
+
+	auto parallel = [threads](const std::function<void(size_t)>& f) {
+
+		std::vector<std::thread> workers;
+
+		for(size_t t = 1; t < threads; t++)
+			workers.emplace_back(f, t);
+
+		f(0);
+
+		for(auto& x : workers)
+			x.join();
+	};
+
+	for(size_t pass = 0; pass < 16; pass++) {
+
+		const size_t shift = 8 * (pass % 8);
+		const bool high = pass >= 8;
+
+		auto digit = [shift, high](const pz_pair_record& r) -> size_t {
+			return ((high ? r.hi : r.lo) >> shift) & (radix - 1);
+		};
+
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		parallel([&](size_t t) {
+			size_t *count = offsets.data() + t * radix;
+			for(size_t i = t * step; i < std::min(n, (t + 1) * step); i++)
+				count[digit(v[i])]++;
+		});
+
+		// offsets of each digit and thread, digits outer so that the sort is stable
+
+		size_t sum = 0;
+		bool skip = false;
+
+		for(size_t d = 0; d < radix; d++) {
+
+			size_t total = 0;
+
+			for(size_t t = 0; t < threads; t++) {
+				const size_t k = offsets[t * radix + d];
+				offsets[t * radix + d] = sum;
+				sum += k;
+				total += k;
+			}
+
+			if(total == n)
+				skip = true;
+		}
+
+		if(skip)
+			continue;
+
+		parallel([&](size_t t) {
+			size_t *next = offsets.data() + t * radix;
+			for(size_t i = t * step; i < std::min(n, (t + 1) * step); i++)
+				w[next[digit(v[i])]++] = v[i];
+		});
+
+		v.swap(w);
+	}
+}
+
+//
+// pz_sketch
+//
+
+pz_sketch::pz_sketch(size_t budget) {
+
+	width = 1024;
+
+	while(2 * width * pz_sketch_depth * sizeof(uint32_t) <= budget)
+		width *= 2;
+
+	counters.assign(width * pz_sketch_depth, 0);
+}
+
+size_t pz_sketch::slot(uint64_t key, size_t row) const {
+
+	static const uint64_t seeds[pz_sketch_depth] = {
+		0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+	};
+
+	uint64_t h = (key + 1) * seeds[row];
+
+	h ^= h >> 32;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+
+	return row * width + (h & (width - 1));
+}
+
+void pz_sketch::add(uint64_t key) {
+
+	const uint32_t least = estimate(key);
+
+	for(size_t row = 0; row < pz_sketch_depth; row++) {
+		uint32_t& c = counters[slot(key, row)];
+		if(c == least and c != UINT32_MAX)
+			c++;
+	}
+}
+
+uint32_t pz_sketch::estimate(uint64_t key) const {
+
+	uint32_t least = UINT32_MAX;
+
+	for(size_t row = 0; row < pz_sketch_depth; row++)
+		least = std::min(least, counters[slot(key, row)]);
+
+	return least;
+}
+
+//
+// pz_memfd
+//
+
+int pz_memfd(const char *name, const void *p, size_t sz) {
+
+	int fd = memfd_create(name, 0);
+
+	if(fd == -1)
+		throw std::runtime_error(std::string("memfd_create(): ") + strerror(errno));
+
+	for(size_t done = 0; done < sz; ) {
+
+		ssize_t n = ::write(fd, (const char *)p + done, sz - done);
+
+		if(n == -1 and errno == EINTR)
+			continue;
+
+		if(n <= 0) {
+			close(fd);
+			throw std::runtime_error(std::string("pz_memfd(): ") + strerror(errno));
+		}
+
+		done += n;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+
+	return fd;
+}
+
+int pz_tmpfile() {
+
+	const char *dir = getenv("TMPDIR");
+
+	if(dir == nullptr or *dir == '\0')
+		dir = "/tmp";
+
+	int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+
+	if(fd != -1)
+		return fd;
+
+	// file systems without O_TMPFILE get a named file, unlinked at once
+
+	std::string name = std::string(dir) + "/pzXXXXXX";
+
+	fd = mkstemp(&name[0]);
+
+	if(fd == -1)
+		throw std::runtime_error(std::string("pz_tmpfile(): ") + strerror(errno));
+
+	unlink(name.c_str());
+
+	return fd;
+}
+
+pz_fd::~pz_fd() {
+	if(fd != -1)
+		close(fd);
+}
+
+std::string pz_slurp(int fd) {
+
+	std::string s;
+	char buf[1 << 16];
+	ssize_t n;
+
+	while((n = ::read(fd, buf, sizeof(buf))) != 0) {
+		if(n == -1 and errno == EINTR)
+			continue;
+		if(n == -1)
+			throw std::runtime_error(std::string("pz_slurp(): ") + strerror(errno));
+		s.append(buf, n);
+	}
+
+	return s;
+}
+
+//
+// pz_dictionary
+//
+
+const uint8_t pz_dictionary::magic[4] = { 'p', 'z', 0x1a, 'D' };
+
+static size_t pz_align8(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+pz_dictionary::~pz_dictionary() {
+	if(map != nullptr)
+		munmap(map, mapped);
+}
+
+void pz_dictionary::attach(const void *image, size_t sz) {
+
+	// points the sections into an image, which is checked to hold them
+
+	const uint8_t *p = (const uint8_t *)image;
+
+	header h;
+
+	if(sz < sizeof(h))
+		throw std::runtime_error("not a dictionary");
+
+	memcpy(&h, p, sizeof(h));
+
+	if(memcmp(h.magic, magic, sizeof(magic)) != 0)
+		throw std::runtime_error("not a dictionary");
+
+	if(h.rules >= 0xFFFE - 256 or h.nodes == 0 or h.symbols > sz or h.bytes > sz or
+	   h.edges == 0 or h.edges > sz or (h.edges & (h.edges - 1)) != 0 or
+	   h.pairs == 0 or h.pairs > sz or (h.pairs & (h.pairs - 1)) != 0)
+		throw std::runtime_error("corrupt dictionary");
+
+	size_t at = pz_align8(sizeof(h));
+
+	auto section = [&](size_t n) -> const uint8_t * {
+		const uint8_t *q = p + at;
+		at = pz_align8(at + n);
+		if(at > sz)
+			throw std::runtime_error("corrupt dictionary");
+		return q;
+	};
+
+	id = h.id;
+	rules = h.rules;
+
+	bodies     = (const uint32_t *)section((h.rules + 1) * sizeof(uint32_t));
+	symbols    = (const uint16_t *)section(h.symbols * sizeof(uint16_t));
+	offsets    = (const uint32_t *)section((h.rules + 1) * sizeof(uint32_t));
+	expansions = (const uint8_t *)section(h.bytes + pz_short_copy);
+	edges      = (const slot *)section(h.edges * sizeof(slot));
+	pairs      = (const slot *)section(h.pairs * sizeof(slot));
+	terminal   = (const uint16_t *)section(h.nodes * sizeof(uint16_t));
+
+	edge_mask = h.edges - 1;
+	pair_mask = h.pairs - 1;
+
+	if(bodies[rules] != h.symbols or offsets[rules] != h.bytes)
+		throw std::runtime_error("corrupt dictionary");
+
+	// build() leaves both hashes at most half full, and every value names a
+	// node or a rule. a fuller table would make each miss probe all of it
+
+	auto rule = [&](uint64_t x) -> bool {
+		return x >= 256 and x < 256 + rules;
+	};
+
+	auto table = [&](const slot *t, uint64_t n, const std::function<bool(uint64_t)>& valid) {
+		uint64_t used = 0;
+		for(uint64_t k = 0; k < n; k++)
+			if(t[k].key != 0 and (++used > n / 2 or not valid(t[k].value)))
+				throw std::runtime_error("corrupt dictionary");
+	};
+
+	table(edges, h.edges, [&](uint64_t x) { return x > 0 and x < h.nodes; });
+	table(pairs, h.pairs, rule);
+
+	for(size_t k = 0; k < h.nodes; k++)
+		if(terminal[k] != 0 and not rule(terminal[k]))
+			throw std::runtime_error("corrupt dictionary");
+}
+
+void pz_dictionary::build(const std::vector<std::vector<uint16_t>>& bodies_in) {
+
+	// bodies only name lower rules, so expansions are built in order
+
+	header h;
+
+	memcpy(h.magic, magic, sizeof(magic));
+
+	h.rules = bodies_in.size();
+
+	std::vector<uint32_t> b(1, 0);
+	std::vector<uint16_t> v;
+	std::vector<uint32_t> o(1, 0);
+	std::string e;
+
+	for(size_t n = 0; n < bodies_in.size(); n++) {
+
+		if(bodies_in[n].empty())
+			throw std::runtime_error("pz_dictionary::build(): empty rule");
+
+		for(uint16_t x : bodies_in[n]) {
+
+			if(x >= 256 + n)
+				throw std::runtime_error("pz_dictionary::build(): rule names a later rule");
+
+			v.push_back(x);
+
+			if(x < 256)
+				e.push_back((char)x);
+			else
+				e.append(e, o[x - 256], o[x - 255] - o[x - 256]);
+		}
+
+		b.push_back(v.size());
+		o.push_back(e.size());
+	}
+
+	std::vector<uint16_t> written;
+
+	for(const auto& rule : bodies_in) {
+		written.insert(written.end(), rule.begin(), rule.end());
+		written.push_back(0xFFFF);
+	}
+
+	h.id = pz_crc32c(0, written.data(), written.size() * sizeof(uint16_t));
+
+	// the trie, then both hashes at most half full
+
+	std::vector<std::pair<uint64_t,uint64_t>> trie;
+	std::vector<uint16_t> ends(1, 0);
+	std::map<uint64_t,uint64_t> children;
+
+	for(size_t n = 0; n < bodies_in.size(); n++) {
+
+		uint64_t node = 0;
+
+		for(size_t k = o[n]; k < o[n + 1]; k++) {
+
+			auto edge = children.emplace((node + 1) << 8 | (uint8_t)e[k], ends.size());
+
+			if(edge.second)
+				ends.push_back(0);
+
+			node = edge.first->second;
+		}
+
+		if(ends[node] == 0)
+			ends[node] = 256 + n;
+	}
+
+	std::vector<std::pair<uint64_t,uint64_t>> twos;
+
+	for(size_t n = 0; n < bodies_in.size(); n++)
+		if(bodies_in[n].size() == 2)
+			twos.emplace_back((uint64_t)(bodies_in[n][0] + 1) << 16 | bodies_in[n][1], 256 + n);
+
+	auto slots = [](size_t n) -> uint64_t {
+		uint64_t k = 16;
+		while(k < 2 * n)
+			k <<= 1;
+		return k;
+	};
+
+	h.nodes = ends.size();
+	h.symbols = v.size();
+	h.bytes = e.size();
+	h.edges = slots(children.size());
+	h.pairs = slots(twos.size());
+
+	e.append(pz_short_copy, '\0');
+
+	const size_t sz =
+		pz_align8(sizeof(h)) +
+		pz_align8(b.size() * sizeof(uint32_t)) +
+		pz_align8(v.size() * sizeof(uint16_t)) +
+		pz_align8(o.size() * sizeof(uint32_t)) +
+		pz_align8(e.size()) +
+		pz_align8(h.edges * sizeof(slot)) +
+		pz_align8(h.pairs * sizeof(slot)) +
+		pz_align8(ends.size() * sizeof(uint16_t));
+
+	if(map != nullptr)
+		munmap(map, mapped);
+
+	map = nullptr;
+	storage.assign(sz / 8, 0);
+
+	uint8_t *p = (uint8_t *)storage.data();
+	size_t at = 0;
+
+	auto put = [&](const void *q, size_t n) -> uint8_t * {
+		uint8_t *r = p + at;
+		if(n > 0)
+			memcpy(r, q, n);
+		at = pz_align8(at + n);
+		return r;
+	};
+
+	put(&h, sizeof(h));
+	put(b.data(), b.size() * sizeof(uint32_t));
+	put(v.data(), v.size() * sizeof(uint16_t));
+	put(o.data(), o.size() * sizeof(uint32_t));
+	put(e.data(), e.size());
+
+	auto fill = [&](const std::vector<std::pair<uint64_t,uint64_t>>& entries, uint64_t n) {
+
+		slot *t = (slot *)(p + at);
+
+		for(const auto& x : entries) {
+			slot *s = (slot *)find(t, n - 1, x.first);
+			if(s == nullptr)
+				throw std::runtime_error("pz_dictionary::build(): hash table full");
+			s->key = x.first;
+			s->value = x.second;
+		}
+
+		at = pz_align8(at + n * sizeof(slot));
+	};
+
+	fill(std::vector<std::pair<uint64_t,uint64_t>>(children.begin(), children.end()), h.edges);
+	fill(twos, h.pairs);
+
+	put(ends.data(), ends.size() * sizeof(uint16_t));
+
+	attach(p, sz);
+}
+
+void pz_dictionary::load(const std::string& filename) {
+
+	int fd = open(filename.c_str(), O_RDONLY);
+
+	if(fd == -1)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+
+	struct stat sb;
+
+	if(fstat(fd, &sb) == -1 or sb.st_size == 0) {
+		close(fd);
+		throw std::runtime_error(filename + ": not a dictionary");
+	}
+
+	void *p = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if(p == MAP_FAILED)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+
+	if(map != nullptr)
+		munmap(map, mapped);
+
+	storage.clear();
+
+	map = p;
+	mapped = sb.st_size;
+
+	try {
+		attach(p, mapped);
+	} catch(const std::exception& e) {
+		throw std::runtime_error(filename + ": " + e.what());
+	}
+}
+
+void pz_dictionary::save(const std::string& filename) const {
+
+	std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+
+	if(map != nullptr)
+		os.write((const char *)map, mapped);
+	else
+		os.write((const char *)storage.data(), storage.size() * sizeof(uint64_t));
+
+	os.close();
+
+	if(not os)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+}
+
+//
+// pz_message
+//
+
+size_t pz_message_compress(const pz_dictionary& d, const void *in, size_t sz, void *out, size_t cap) {
+
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *q = (uint8_t *)out;
+
+	size_t used = 0;
+	size_t run = SIZE_MAX; // where the open literal run has its token, if any
+
+	for(size_t n = 0; n < sz; ) {
+
+		uint16_t x = 0;
+
+		// rules past pz_message_rules have no token, so a match of one steps
+		// back to the longest shorter one that has
+
+		size_t k = d.match(p + n, sz - n, &x, pz_message_rules);
+
+		const size_t rule = x - 256;
+		const size_t cost = (rule < 64) ? 1 : 2;
+
+		if(k > cost) {
+
+			if(used + cost > cap)
+				return pz_message_error;
+
+			if(rule < 64) {
+				q[used++] = 0x80 | rule;
+			} else {
+				q[used++] = 0xc0 | (rule - 64) >> 8;
+				q[used++] = (rule - 64) & 0xff;
+			}
+
+			run = SIZE_MAX;
+			n += k;
+
+			continue;
+		}
+
+		if(run == SIZE_MAX or q[run] == 0x7f) {
+
+			if(used + 2 > cap)
+				return pz_message_error;
+
+			run = used;
+			q[used++] = 0;
+			q[used++] = p[n++];
+
+			continue;
+		}
+
+		if(used + 1 > cap)
+			return pz_message_error;
+
+		q[run]++;
+		q[used++] = p[n++];
+	}
+
+	return used;
+}
+
+size_t pz_message_decompress(const pz_dictionary& d, const void *in, size_t sz, void *out, size_t cap) {
+
+	const uint8_t *p = (const uint8_t *)in;
+	uint8_t *q = (uint8_t *)out;
+
+	size_t used = 0;
+
+	for(size_t n = 0; n < sz; ) {
+
+		const uint8_t t = p[n++];
+
+		if(t < 0x80) {
+
+			const size_t k = t + 1;
+
+			if(k > sz - n or k > cap - used)
+				return pz_message_error;
+
+			memcpy(q + used, p + n, k);
+
+			used += k;
+			n += k;
+
+			continue;
+		}
+
+		size_t rule = t & 0x3f;
+
+		if(t >= 0xc0) {
+			if(n == sz)
+				return pz_message_error;
+			rule = 64 + (rule << 8 | p[n++]);
+		}
+
+		if(rule >= d.size())
+			return pz_message_error;
+
+		const size_t k = d.offsets[rule + 1] - d.offsets[rule];
+		const uint8_t *x = d.expansions + d.offsets[rule];
+
+		if(k > cap - used)
+			return pz_message_error;
+
+		if(k <= pz_short_copy and cap - used >= pz_short_copy)
+			pz_copy_short(q + used, x, k);
+		else
+			memcpy(q + used, x, k);
+
+		used += k;
+	}
+
+	return used;
+}
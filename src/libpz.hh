@@ -1 +1,486 @@
 #pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+//
+// pz_crc32c
+//
+// crc32c (castagnoli) of sz bytes at p, continuing from crc. start from 0.
+// pz_crc32c_combine(crc(a), crc(b), length of b) is crc(a + b).
+//
+
+uint32_t pz_crc32c(uint32_t crc, const void *p, size_t sz);
+uint32_t pz_crc32c_combine(uint32_t, uint32_t, size_t);
+
+//
+// pz_clock
+//
+// wall time and cpu time of the calling thread, in seconds.
+//
+
+struct pz_clock {
+
+	double wall = 0;
+	double cpu = 0;
+
+	static pz_clock now();
+
+	pz_clock operator-(const pz_clock& r) const {
+		pz_clock x;
+		x.wall = wall - r.wall;
+		x.cpu = cpu - r.cpu;
+		return x;
+	}
+
+	pz_clock& operator+=(const pz_clock& r) {
+		wall += r.wall;
+		cpu += r.cpu;
+		return *this;
+	}
+};
+
+//
+// pz_stats
+//
+// machine readable measurements of a run, written as json by --stats=FILE.
+// tools keep a pz_stats * that is null unless stats were asked for and test
+// it before measuring anything, so an uninstrumented run does no extra work.
+//
+
+struct pz_round_stats {
+	size_t round = 0;
+	pz_clock time;
+	size_t histogram = 0;    // distinct n-grams counted
+	size_t candidates = 0;   // n-grams selected for replacement
+	size_t replacements = 0;
+	size_t created = 0;      // rules created
+	size_t inlined = 0;      // singleton rules inlined
+	size_t symbols = 0;      // document symbols after the round
+	size_t rules = 0;        // live rules after the round
+	size_t allocated = 0;    // heap bytes allocated during the round
+};
+
+struct pz_block_stats {
+	std::string mode;
+	size_t input = 0;
+	size_t output = 0;
+	pz_clock time;
+	std::map<std::string,pz_clock> phases;
+	std::vector<pz_round_stats> rounds;
+	std::map<size_t,size_t> rule_lengths;      // rule body length => rules
+	std::map<size_t,size_t> expansion_lengths; // expanded rule length => rules
+};
+
+struct pz_source_stats {
+	std::string name;
+	std::list<pz_block_stats> blocks;
+};
+
+struct pz_stats {
+
+	std::string tool;
+	size_t peak_heap = 0; // bytes, filled in by a tool that tracks its heap
+	std::list<pz_source_stats> sources;
+	std::map<std::string,pz_source_stats *> index;
+	std::mutex lock;
+
+	pz_stats(const std::string&);
+
+	void add(const std::string&, pz_block_stats&&);
+	void write(std::ostream&);
+	bool write(const std::string&);
+};
+
+//
+// pz_phase
+//
+// adds the time until stop() or the end of the scope to a phase of a block,
+// if there is a block.
+//
+
+struct pz_phase {
+
+	pz_block_stats *block;
+	const char *name;
+	pz_clock start;
+
+	pz_phase(pz_block_stats *b, const char *n) : block(b), name(n) {
+		if(block != nullptr)
+			start = pz_clock::now();
+	}
+
+	~pz_phase() {
+		stop();
+	}
+
+	void stop() {
+		if(block != nullptr)
+			block->phases[name] += pz_clock::now() - start;
+		block = nullptr;
+	}
+};
+
+//
+// pz_writer
+//
+// buffered output to a file descriptor. small writes are gathered in one
+// large page aligned buffer, a write larger than the buffer goes out
+// together with what is buffered in a single writev(). with direct, whole
+// buffers are written with O_DIRECT where the descriptor allows it and the
+// unaligned tail is written normally by flush(). copy() moves bytes from
+// another descriptor in the kernel, with copy_file_range(), splice() or
+// sendfile(), whichever the two descriptors support. errors throw.
+//
+
+struct pz_writer {
+
+	static constexpr size_t default_capacity = 1 << 20;
+	static constexpr size_t alignment = 4096;
+
+	int fd;
+	bool direct;
+	char *buffer;
+	size_t used = 0;
+	size_t capacity;
+	size_t total = 0;
+
+	pz_writer(int, bool = false, size_t = default_capacity);
+	~pz_writer();
+
+	pz_writer(const pz_writer&) = delete;
+	pz_writer& operator=(const pz_writer&) = delete;
+
+	void write(const void *p, size_t sz) {
+		if(used + sz <= capacity) {
+			memcpy(buffer + used, p, sz);
+			used += sz;
+		} else {
+			overflow(p, sz);
+		}
+	}
+
+	template <typename T> void put(const T& x) {
+		write(&x, sizeof(x));
+	}
+
+	void flush();
+	void copy(int, off_t, size_t);
+
+	size_t written() const {
+		return total + used;
+	}
+
+private:
+
+	void overflow(const void *, size_t);
+	void drain(const struct iovec *, int);
+	void undirect();
+};
+
+//
+// pz_copy_short
+//
+// copies n <= 32 bytes from q to p the way fast lz decoders do, with one or
+// two unaligned 16-byte loads and stores whatever n is. the 32 bytes at q
+// must be readable and those at p writable, past n they are overwritten
+// with whatever follows at q.
+//
+
+constexpr size_t pz_short_copy = 32;
+
+inline void pz_copy_short(uint8_t *p, const uint8_t *q, size_t n) {
+#if defined(__x86_64__)
+	_mm_storeu_si128((__m128i *)p, _mm_loadu_si128((const __m128i *)q));
+	if(n > 16)
+		_mm_storeu_si128((__m128i *)(p + 16), _mm_loadu_si128((const __m128i *)(q + 16)));
+#else
+	memcpy(p, q, n > 16 ? 32 : 16);
+#endif
+}
+
+//
+// pz_suffix_array
+//
+// suffix array of s, whose values lie in [0, alphabet), by prefix doubling
+// with counting sorts, and its lcp array by kasai's method: lcp[i] is the
+// longest common prefix of the suffixes at sa[i - 1] and sa[i], lcp[0] = 0.
+//
+// pz_maximal_repeats picks repeated substrings of at least minlen symbols
+// from the lcp intervals, those covering the most symbols first, each with
+// its occurrences that overlap neither each other nor those of a repeat
+// already picked. a repeat is kept if mincount occurrences are left.
+//
+
+struct pz_repeat {
+	size_t length;
+	std::vector<size_t> positions;
+};
+
+std::vector<int32_t> pz_suffix_array(const std::vector<int32_t>& s, int32_t alphabet);
+std::vector<int32_t> pz_lcp_array(const std::vector<int32_t>& s, const std::vector<int32_t>& sa);
+std::vector<pz_repeat> pz_maximal_repeats(const std::vector<int32_t>& s, int32_t alphabet, size_t minlen, size_t mincount = 2);
+
+//
+// pz_memfd
+//
+// an anonymous in-memory file holding sz bytes from p, at offset 0, so that
+// the fd based entry points of the tools can run on buffers, as the fuzz
+// targets do. pz_slurp reads a descriptor to its end. pz_tmpfile is an
+// anonymous file on disk, in $TMPDIR or /tmp, for data that does not fit
+// in memory. errors throw.
+//
+
+int pz_memfd(const char *, const void *, size_t);
+std::string pz_slurp(int);
+int pz_tmpfile();
+
+//
+// pz_fd owns a descriptor and closes it when it goes out of scope
+//
+
+struct pz_fd {
+
+	int fd;
+
+	explicit pz_fd(int f) : fd(f) {
+	}
+
+	~pz_fd();
+
+	pz_fd(const pz_fd&) = delete;
+	pz_fd& operator=(const pz_fd&) = delete;
+
+	operator int() const {
+		return fd;
+	}
+
+	void swap(pz_fd& x) {
+		std::swap(fd, x.fd);
+	}
+};
+
+//
+// pz_pair_counts
+//
+// flat counts of the byte pairs of s: counts[g][x << 8 | y] is how often x is
+// followed g + 1 symbols later by y with only bytes between them, for gaps g
+// up to gaps. symbols outside [0, 256) are not counted and end the gapped
+// pairs running across them. s is split into one chunk per thread and each
+// chunk is counted into four interleaved sub-histograms, so that a run of the
+// same pair does not wait on the counter it just wrote, then all are summed.
+// threads 0 uses one thread per cpu for large inputs.
+//
+
+std::vector<std::vector<uint64_t>> pz_pair_counts(const std::vector<int32_t>& s, size_t gaps, size_t threads = 0);
+
+//
+// pz_sort_pairs
+//
+// counts pairs by sorting rather than hashing, so that the memory is walked
+// in order whatever the number of distinct pairs. a record is a pair packed
+// into a 128-bit key and the position it was seen at. the records are put
+// in key order by a stable LSD radix sort, a byte per pass, skipping the
+// passes where all of them share the byte. each pass histograms and then
+// scatters one chunk per thread. equal keys end up side by side in position
+// order, a run of them being the occurrences of a pair. threads 0 uses one
+// thread per cpu for large inputs.
+//
+
+struct pz_pair_record {
+	uint64_t hi;
+	uint64_t lo;
+	uint64_t position;
+};
+
+void pz_sort_pairs(std::vector<pz_pair_record>&, size_t threads = 0);
+
+//
+// pz_sketch
+//
+// a count-min sketch of 64-bit keys in about budget bytes: pz_sketch_depth
+// rows of 32-bit counters, each key counted in one counter per row. updates
+// are conservative, only the counters at the key's minimum grow, so that
+// estimate() never counts a key less often than it was added and rarely
+// much more. it picks the keys that may be frequent out of more distinct
+// ones than fit in memory, to be counted exactly after.
+//
+
+constexpr size_t pz_sketch_depth = 4;
+
+struct pz_sketch {
+
+	size_t width;
+	std::vector<uint32_t> counters;
+
+	pz_sketch(size_t budget);
+
+	size_t slot(uint64_t, size_t) const;
+	void add(uint64_t);
+	uint32_t estimate(uint64_t) const;
+};
+
+//
+// pz_dictionary
+//
+// a grammar trained ahead of time on a sample corpus and shared by the
+// inputs compressed with it. rule n is symbol 256 + n and its body holds
+// bytes and lower rules only. the id is the crc32c of the bodies, each
+// followed by 0xFFFF as 16-bit symbols, by which a stream names the
+// dictionary its rules continue from.
+//
+// a dictionary is one position independent image, used in place: a header,
+// then the bodies as offsets into their symbols, the expansions of the
+// rules end to end with offsets, so lengths, followed by pz_short_copy
+// bytes of padding, an open addressing hash of the edges of a trie of the
+// expansions, and one of the rules whose body is a pair, and last the rule
+// ending at each trie node. every section starts 8-byte aligned. build()
+// makes the image in memory, save() writes it and load() maps a saved one
+// read only, so that any number of processes share it through the page
+// cache with nothing to parse. load() only checks that the sections fit,
+// a dictionary is trusted like the program using it. errors throw.
+//
+// match() is the length of the longest expansion at the start of p and
+// its rule, 0 if there is none. pair() is the rule whose body is x y, 0 if
+// there is none. once built or loaded a dictionary is only read.
+//
+
+struct pz_dictionary {
+
+	static const uint8_t magic[4];
+
+	struct header {
+		uint8_t  magic[4];
+		uint32_t id;
+		uint32_t rules;
+		uint32_t nodes;  // trie nodes, the root is 0
+		uint64_t symbols;
+		uint64_t bytes;  // expansion bytes, without the padding
+		uint64_t edges;  // edge hash slots, a power of two
+		uint64_t pairs;  // pair hash slots, a power of two
+	};
+
+	struct slot {
+		uint64_t key;    // 0 if the slot is empty
+		uint64_t value;
+	};
+
+	uint32_t id = 0;
+	size_t rules = 0;
+
+	const uint32_t *bodies = nullptr;     // rule => first symbol of its body, one past the last
+	const uint16_t *symbols = nullptr;
+	const uint32_t *offsets = nullptr;    // rule => first byte of its expansion, one past the last
+	const uint8_t *expansions = nullptr;
+	const slot *edges = nullptr;          // (node + 1) << 8 | byte => node
+	const slot *pairs = nullptr;          // (x + 1) << 16 | y => rule
+	const uint16_t *terminal = nullptr;   // node => rule ending there, 0 if none
+
+	uint64_t edge_mask = 0;
+	uint64_t pair_mask = 0;
+
+	pz_dictionary() = default;
+	~pz_dictionary();
+
+	pz_dictionary(const pz_dictionary&) = delete;
+	pz_dictionary& operator=(const pz_dictionary&) = delete;
+
+	void build(const std::vector<std::vector<uint16_t>>&);
+	void load(const std::string&);
+	void save(const std::string&) const;
+
+	size_t size() const {
+		return rules;
+	}
+
+	static uint64_t hash(uint64_t key) {
+		return key * 0x9e3779b97f4a7c15ULL;
+	}
+
+	// nullptr if the key is missing from a table with no empty slot, which
+	// attach() refuses, so only a table still being filled gets one
+
+	static const slot *find(const slot *t, uint64_t mask, uint64_t key) {
+		for(uint64_t n = hash(key) >> 32, k = 0; k <= mask; n++, k++)
+			if(t[n & mask].key == key or t[n & mask].key == 0)
+				return &t[n & mask];
+		return nullptr;
+	}
+
+	uint16_t pair(uint16_t x, uint16_t y) const {
+		const slot *s = find(pairs, pair_mask, (uint64_t)(x + 1) << 16 | y);
+		return (s == nullptr) ? 0 : s->value;
+	}
+
+	// the longest rule prefix of p among the first limit rules
+
+	size_t match(const uint8_t *p, size_t sz, uint16_t *x, size_t limit = SIZE_MAX) const {
+
+		size_t best = 0;
+		uint64_t node = 0;
+
+		for(size_t n = 0; n < sz; n++) {
+
+			const slot *edge = find(edges, edge_mask, (node + 1) << 8 | p[n]);
+
+			if(edge == nullptr or edge->key == 0)
+				break;
+
+			node = edge->value;
+
+			if(terminal[node] != 0 and terminal[node] - 256u < limit) {
+				best = n + 1;
+				*x = terminal[node];
+			}
+		}
+
+		return best;
+	}
+
+private:
+
+	std::vector<uint64_t> storage;
+	void *map = nullptr;
+	size_t mapped = 0;
+
+	void attach(const void *, size_t);
+};
+
+//
+// pz_message_compress, pz_message_decompress
+//
+// small buffers such as rpc payloads, compressed against a shared indexed
+// dictionary into a buffer of the caller, with no header, no checksum and
+// no heap allocation, and back. the output is a run of tokens: 0x00-0x7f
+// and that many plus one literal bytes, 0x80-0xbf for rules 0-63 and
+// 0xc0-0xff with one more byte for rules 64 on, up to pz_message_rules.
+// the dictionary is only read, so any number of threads may share one.
+// both return the bytes written, or pz_message_error if they do not fit
+// in cap or the input to pz_message_decompress is corrupt. a buffer of
+// pz_message_bound(sz) bytes always holds sz bytes compressed.
+//
+
+constexpr size_t pz_message_error = SIZE_MAX;
+constexpr size_t pz_message_rules = 64 + (64 << 8);
+
+constexpr size_t pz_message_bound(size_t sz) {
+	return sz + (sz + 127) / 128;
+}
+
+size_t pz_message_compress(const pz_dictionary&, const void *, size_t, void *, size_t);
+size_t pz_message_decompress(const pz_dictionary&, const void *, size_t, void *, size_t);
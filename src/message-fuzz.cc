@@ -0,0 +1,92 @@
+/////////////////////////////////
+//                             //
+// message-fuzz                //
+// message api fuzz target     //
+//                             //
+// Copyright(c) 2016 256 LLC   //
+// Written by Christopher Abad //
+// aempirei@256.bz             //
+// 20 GOTO 10                  //
+//                             //
+/////////////////////////////////
+
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <libpz.hh>
+
+//
+// a dictionary of more than 64 rules, so that both token forms come up:
+// some words, then pairs of words and earlier pairs, long and short
+//
+
+static const pz_dictionary& message_dictionary() {
+
+	static pz_dictionary d;
+	static bool built = false;
+
+	if(built)
+		return d;
+
+	const char *words[] = {
+		"the ", "of ", "and ", "to ", "in ", "is ", "that ", "for ", "on ", "with ",
+		"\"id\":", "\"name\":", "\"status\":", "\"ok\"", "true", "false", "null", "{\"", "\"}", ", ",
+	};
+
+	std::vector<std::vector<uint16_t>> bodies;
+
+	for(const char *w : words)
+		bodies.emplace_back(w, w + strlen(w));
+
+	for(size_t n = 0; bodies.size() < 400; n++)
+		bodies.push_back({ (uint16_t)(256 + n % bodies.size()), (uint16_t)(256 + (n * 7 + 3) % bodies.size()) });
+
+	d.build(bodies);
+	built = true;
+
+	return d;
+}
+
+//
+// libfuzzer entry point, built by make fuzz. with the low bit of the first
+// byte set the rest is decompressed as it is, untrusted, into a buffer of
+// 64 times the second byte, which may fail but must not write past it.
+// otherwise the rest is compressed and must decompress back to itself
+//
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+	if(size < 2)
+		return 0;
+
+	const pz_dictionary& d = message_dictionary();
+
+	if(data[0] & 1) {
+
+		std::vector<uint8_t> out(64 * (size_t)data[1]);
+
+		const size_t n = pz_message_decompress(d, data + 2, size - 2, out.data(), out.size());
+
+		if(n != pz_message_error and n > out.size())
+			abort();
+
+	} else {
+
+		const uint8_t *m = data + 1;
+		const size_t sz = size - 1;
+
+		std::vector<uint8_t> packed(pz_message_bound(sz));
+		std::vector<uint8_t> back(sz);
+
+		const size_t n = pz_message_compress(d, m, sz, packed.data(), packed.size());
+
+		if(n == pz_message_error or n > packed.size())
+			abort();
+
+		if(pz_message_decompress(d, packed.data(), n, back.data(), back.size()) != sz or memcmp(back.data(), m, sz) != 0)
+			abort();
+	}
+
+	return 0;
+}
@@ -25,47 +25,264 @@
 #include <map>
 #include <algorithm>
 #include <set>
+#include <queue>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <numeric>
+#include <cmath>
+#include <thread>
 
 extern "C" {
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 }
 
 #include <libpz.hh>
 #include <config.hh>
 #include <symbol.hh>
+#include <table.hh>
+#include <jobs.hh>
+#include <heap.hh>
 
 template <typename T> using meta = std::pair<bool, T>;
 template <typename T> using metric = std::map<T,size_t>;
 
 using block = std::list<symbol>;
+using digram = std::pair<symbol,symbol>;
 using histogram = metric<block>;
-using dictionary = std::map<symbol,block>;
-using rdictionary = std::map<block,symbol>;
+using dictionary = rule_table<symbol,block,(int)symbol::first>;
+using rdictionary = std::unordered_map<digram,symbol,pair_hash>;
+using census = rule_census<dictionary>;
 using dictionary_rule = dictionary::value_type;
 using measurement = histogram::value_type;
 
 const char *pz_extension = ".pz";
 
-bool pz_process_file(const config&, const char *);
-bool pz_process_fd(const config&, int, int);
+//
+// a .pz stream is pz_magic followed by frames. each frame is a self contained
+// grammar over one window of input: the frame header, the rules as
+// [symbol, body..., wildcard] and then the document, all as 16-bit symbols,
+// and last the argument bytes of gapped rules. a run of n wildcards in a
+// rule body is written as [pz_gap, n]. in the document each use of a gapped
+// rule is followed by one argument byte per wildcard of its body, which are
+// kept apart from the symbols and put back in place when reading.
+// a frame of length zero ends the stream. frames flagged pz_frame_crc32c
+// carry the crc32c of their expanded bytes, and a flagged end frame the
+// crc32c of the whole stream, both checked on decompression. a frame
+// flagged pz_frame_stored holds its bytes as they are, with no grammar.
+// the payload of a frame flagged pz_frame_shared starts with the id of the
+// pz_dictionary given with -D, whose rules are symbols 256 and on and are
+// not written, those of the frame following them.
+//
+
+const uint8_t pz_magic[4] = { 'p', 'z', 0x1a, 0x02 };
+
+struct pz_frame {
+    uint64_t length    = 0; // expanded size in bytes
+    uint64_t size      = 0; // payload size in bytes
+    uint64_t symbols   = 0; // document symbols
+    uint32_t rules     = 0; // dictionary rules
+    uint32_t flags     = 0;
+    uint32_t check     = 0; // crc32c of the expanded bytes
+    uint32_t arguments = 0; // argument bytes of gapped rules
+};
+
+constexpr uint32_t pz_frame_crc32c = 1 << 0;
+constexpr uint32_t pz_frame_stored = 1 << 1;
+constexpr uint32_t pz_frame_shared = 1 << 2;
+
+constexpr uint16_t pz_gap = 0xFFFE;
+
+constexpr size_t pz_stream_window = 1 << 20;
+
+// heap bytes of a pair counted exactly in an unordered_map and of a longer
+// n-gram counted in a histogram, about
+
+constexpr size_t pz_histogram_entry = 48;
+constexpr size_t pz_ngram_entry = 160;
+
+//
+// the decoder expands each rule of at most pz_short_copy bytes once into a
+// padded table, from which a use is copied whole with pz_copy_short. such
+// a copy writes on past the expansion, which the next copies overwrite, so
+// it is only used where that stays within the slice being expanded.
+//
+
+struct pz_short_rules {
+    std::vector<uint32_t> offsets; // rule => table offset, none if the rule is long
+    std::vector<uint8_t> sizes;
+    std::vector<uint8_t> table;
+
+    static constexpr uint32_t none = UINT32_MAX;
+};
+
+constexpr uint32_t pz_short_rules::none;
+
+//
+// a frame numbers its own rules after those of the shared dictionary, but
+// in memory they come first from symbol::first and the shared rules are
+// numbered from first on. the decoder puts them right after the rules of
+// the frame, the encoder far above any rule it can make. shared rules are
+// looked up where the dictionary is mapped and never copied, so what a
+// frame costs does not grow with the dictionary.
+//
+
+struct pz_shared_rules {
+    const pz_dictionary *mapped = nullptr;
+    symbol first = symbol::first;
+
+    size_t size() const {
+        return mapped == nullptr ? 0 : mapped->size();
+    }
+
+    size_t index(symbol x) const {
+        return (size_t)((int)x - (int)first);
+    }
+
+    bool contains(symbol x) const {
+        return mapped != nullptr and x >= first and index(x) < mapped->size();
+    }
+
+    symbol pair(symbol x, symbol y) const {
+
+        // the shared rule whose body is x y, symbol::wildcard if none
+
+        auto id = [this](symbol z) -> int {
+            if(z >= symbol::min_ascii and z <= symbol::max_ascii)
+                return (int)z;
+            return contains(z) ? (int)symbol::first + (int)index(z) : -1;
+        };
+
+        if(mapped == nullptr or id(x) == -1 or id(y) == -1)
+            return symbol::wildcard;
+
+        const uint16_t z = mapped->pair((uint16_t)id(x), (uint16_t)id(y));
+
+        return z == 0 ? symbol::wildcard : first + (z - (int)symbol::first);
+    }
+
+    uint64_t length(symbol x) const {
+        return mapped->offsets[index(x) + 1] - mapped->offsets[index(x)];
+    }
+
+    const uint8_t *expansion(symbol x) const {
+        return mapped->expansions + mapped->offsets[index(x)];
+    }
+};
 
-bool pz_compress(const config&, int, int);
-bool pz_decompress(const config&, int, int);
+//
+// before a block is compressed a probe samples a few windows of it for their
+// order-0 byte entropy and for how many of their digrams repeat. blocks that
+// look incompressible are stored, blocks with little repetition only get a
+// couple of induction rounds.
+//
+
+enum struct pz_mode { store, cheap, full };
+
+struct pz_probe {
+    pz_mode mode     = pz_mode::full;
+    double  entropy  = 0; // bits per byte
+    double  repeats  = 0; // fraction of sampled digrams seen pz_probe_multiplicity times
+};
+
+constexpr size_t pz_probe_windows      = 4;
+constexpr size_t pz_probe_window       = 4096;
+constexpr size_t pz_probe_multiplicity = 4;
+constexpr size_t pz_probe_minimum      = 1024;
+
+const char *pz_mode_name[] = { "store", "cheap", "full" };
+
+//
+// compression levels. each round counts the n-grams of up to maxlen symbols
+// and replaces those seen at least multiplicity times, at each position the
+// one that saves the most bytes. at most rounds rounds are run, 0 being until
+// nothing repeats. cheap blocks get level 1 whatever the level, level 0 is
+// store mode. with gapped, once no n-gram repeats, rounds go on with pairs
+// up to maxlen - 1 symbols apart with only bytes between them. such a pair
+// becomes a rule [x, wildcard..., y] whose gap bytes stay in the document
+// as arguments. with repeats, maximal repeats of at least that many symbols
+// become rules of their own before the first round.
+//
+// -1 to -3 only count pairs, each level at a lower threshold and for more
+// rounds, -3 until nothing repeats. from -4 on trigrams and gapped pairs are
+// counted too. which threshold and repeat length suit a block best swings
+// by several percent from one kind of input to the next, so from -5 on the
+// block is induced again with each of the alternatives, a multiplicity and
+// a repeat length, the smallest frame kept. each level tries one more than
+// the level below it, so it never compresses worse and does one induction
+// more. blocks of the out-of-core path and --train only use the profile.
+//
+
+struct pz_profile {
+    size_t multiplicity;
+    size_t maxlen;
+    bool   gapped;
+    size_t rounds;
+    size_t repeats;
+    std::vector<std::pair<size_t,size_t>> alternatives;
+};
+
+const pz_profile pz_profiles[10] = {
+    {  0, 0, false, 0, 0, {} },
+    { 16, 2, false, 2, 4, {} },
+    { 12, 2, false, 4, 4, {} },
+    { 10, 2, false, 0, 4, {} },
+    {  9, 3, true,  0, 4, {} },
+    {  9, 3, true,  0, 4, { { 10, 8 } } },
+    {  9, 3, true,  0, 4, { { 10, 8 }, { 10, 3 } } },
+    {  9, 3, true,  0, 4, { { 10, 8 }, { 10, 3 }, { 8, 4 } } },
+    {  9, 3, true,  0, 4, { { 10, 8 }, { 10, 3 }, { 8, 4 }, { 10, 0 } } },
+    {  9, 3, true,  0, 4, { { 10, 8 }, { 10, 3 }, { 8, 4 }, { 10, 0 }, { 10, 2 } } },
+};
+
+bool pz_process_file(const config&, const char *);
+bool pz_process_fd(const config&, int, int, const char *);
+
+bool pz_compress(const config&, int, int, const char *);
+bool pz_store(const config&, int, const struct stat&, size_t, pz_writer&, pz_frame&, const char *);
+bool pz_compress_external(const config&, int, const pz_profile&, pz_writer&, pz_frame&, const char *);
+bool pz_compress_external_frame(const config&, int, const pz_profile&, uint64_t, pz_writer&, pz_frame&, const char *, bool&);
+bool pz_compress_block(const config&, block&, uint32_t, const pz_profile&, pz_writer&, pz_block_stats *);
+uint64_t pz_frame_size(const block&, const dictionary&);
+void pz_induce(const config&, block&, dictionary&, const pz_profile&, pz_block_stats *);
+void pz_induce_best(const config&, block&, dictionary&, const pz_profile&, pz_block_stats *);
+pz_shared_rules pz_share(const config&);
+bool pz_train(const config&);
+void pz_print_grammar(const config&, const block&, const dictionary&);
+void pz_store_block(const block&, uint32_t, pz_writer&, pz_block_stats *);
+pz_probe pz_probe_block(const block&);
+bool pz_decompress(const config&, int, int, const char *);
 
 bool pz_compare_symbols(symbol, symbol);
+bool pz_is_argument(symbol);
+symbol pz_argument(symbol);
+symbol pz_literal(symbol);
 
 template <typename T> bool pz_match_block(T, T, const block&);
 template <typename T> T pz_find_block(T, T, const block&);
 template <typename T> typename T::iterator pz_erase_block(T&, typename T::iterator, const block&);
 template <typename T> typename T::iterator pz_replace_next_block(T&, typename T::iterator, const block&, symbol);
 template <typename T> int pz_replace_block(T&, const block&, symbol);
-template <typename T> histogram pz_get_histogram(const T&, size_t);
-
-meta<block> pz_get_block(int);
-metric<symbol> pz_symbol_histogram(const block&, const dictionary&);
+template <typename T> histogram pz_get_histogram(const T&, size_t, bool, size_t, size_t, bool);
+
+meta<block> pz_get_block(int, size_t, int, bool&, uint32_t&);
+ssize_t pz_read(int, void *, size_t);
+template <typename T> bool pz_read_vector(int, std::vector<T>&, uint64_t);
+void pz_forget_rule(rdictionary&, const dictionary&, symbol);
+void pz_inline_rule(dictionary&, rdictionary&, census&, symbol);
+void pz_rule_lengths(const dictionary&, const pz_shared_rules&, pz_block_stats *);
+bool pz_frozen(const dictionary&, symbol);
+std::vector<uint64_t> pz_expansion_lengths(const dictionary&, const pz_shared_rules&);
+pz_short_rules pz_get_short_rules(const dictionary&, const pz_shared_rules&, const std::vector<uint64_t>&);
+uint8_t *pz_expand_into(const dictionary&, const pz_shared_rules&, const pz_short_rules&, symbol, uint8_t *, const uint8_t *, const symbol *&);
+uint32_t pz_expand_parallel(const std::vector<symbol>&, const dictionary&, const pz_shared_rules&, uint64_t, std::vector<uint8_t>&);
+block::iterator pz_expand_rule(block&, block::iterator, const block&);
 
 const static std::map<unsigned int, const char *> file_type = {
     { S_IFBLK,  "block device" },
@@ -88,6 +305,23 @@ const char *get_file_type(const struct stat& sb) {
     return iter->second;
 }
 
+//
+// the gap bytes of a gapped rule use stay in the document after it as
+// argument symbols, symbol::argument + byte, which no other rule may take
+//
+
+bool pz_is_argument(symbol x) {
+    return x < symbol::wildcard;
+}
+
+symbol pz_argument(symbol x) {
+    return symbol::argument + (int)x;
+}
+
+symbol pz_literal(symbol x) {
+    return x - (int)symbol::argument;
+}
+
 bool pz_compare_symbols(symbol a, symbol b) {
     return a == b or a == symbol::wildcard or b == symbol::wildcard;
 }
@@ -160,125 +394,321 @@ template <typename T> int pz_replace_block(T& b, const block& s, symbol x) {
     return n;
 }
 
-template <typename T> histogram pz_get_histogram(const T& b, size_t maxlen) {
+template <typename T> histogram pz_get_histogram(const T& b, size_t maxlen, bool gapped, size_t minimum, size_t sketch, bool sort) {
+
+    // counts the n-grams of 2 to maxlen symbols and, if gapped, the pairs
+    // up to maxlen - 1 symbols apart with only bytes between them, with
+    // wildcards for the gap. pairs of bytes are counted in flat tables and
+    // only those seen minimum times make it into the histogram. an n-gram
+    // seen minimum times has each of its digrams seen as often, so longer
+    // n-grams are only counted where all of their digrams were. with a
+    // sketch budget, the other pairs and then the longer n-grams each go
+    // through a pz_sketch first when there are more of them than it could
+    // count exactly, and only the ones it estimates minimum times are
+    // counted, which loses none of them. with sort the other pairs are
+    // counted by pz_sort_pairs rather than in a hash
+
+    std::vector<int32_t> s;
+
+    s.reserve(b.size());
+
+    for(symbol x : b)
+        s.push_back((int32_t)x);
+
+    const size_t n = s.size();
+    const size_t gaps = (gapped and maxlen > 2) ? maxlen - 2 : 0;
+    const size_t least = std::max<size_t>(minimum, 1);
+
+    auto byte = [](int32_t x) -> bool {
+        return x >= 0 and x < 256;
+    };
+
+    const auto counts = pz_pair_counts(s, gaps);
+
+    auto other = [&](size_t i) -> bool {
+        return not byte(s[i]) or not byte(s[i + 1]);
+    };
+
+    auto key = [&s](size_t i) -> uint64_t {
+        return (uint64_t)(uint32_t)s[i] << 32 | (uint32_t)s[i + 1];
+    };
+
+    size_t pairs = 0;
+
+    for(size_t i = 0; i + 1 < n; i++)
+        if(other(i))
+            pairs++;
 
+    std::unique_ptr<pz_sketch> estimates;
+
+    if(sketch != 0 and pairs * pz_histogram_entry > sketch) {
+
+        estimates.reset(new pz_sketch(sketch));
+
+        for(size_t i = 0; i + 1 < n; i++)
+            if(other(i))
+                estimates->add(key(i));
+    }
+
+    auto counted = [&](size_t i) -> bool {
+        return other(i) and (estimates == nullptr or estimates->estimate(key(i)) >= least);
+    };
 
     histogram h;
 
-    for(auto iter = b.begin(); iter != b.end(); iter++) {
+    std::vector<bool> frequent(n, false);
+
+    for(size_t k = 0; k < counts[0].size(); k++)
+        if(counts[0][k] >= least)
+            h[{ (symbol)(k >> 8), (symbol)(k & 0xff) }] = counts[0][k];
+
+    for(size_t i = 0; i + 1 < n; i++)
+        if(not other(i))
+            frequent[i] = counts[0][s[i] << 8 | s[i + 1]] >= least;
+
+    if(sort) {
+
+        // a run of equal keys is a pair and the positions it was seen at
+
+        std::vector<pz_pair_record> records;
+
+        for(size_t i = 0; i + 1 < n; i++)
+            if(counted(i))
+                records.push_back({ 0, key(i), i });
+
+        pz_sort_pairs(records);
+
+        for(size_t first = 0, last; first < records.size(); first = last) {
+
+            for(last = first + 1; last < records.size() and records[last].lo == records[first].lo; last++)
+                ;
+
+            if(last - first >= least) {
 
+                const size_t i = records[first].position;
 
-        const size_t minlen1 = 3;
-        block key1;
+                h[{ (symbol)s[i], (symbol)s[i + 1] }] = last - first;
 
-        for(auto jter = iter; jter != b.end() and key1.size() < maxlen; jter++) {
+                for(size_t k = first; k < last; k++)
+                    frequent[records[k].position] = true;
+            }
+        }
+
+    } else {
 
-            key1.push_back(*jter);
+        std::unordered_map<digram,size_t,pair_hash> others;
 
-            if(key1.size() >= minlen1)
-                h[key1]++;
+        for(size_t i = 0; i + 1 < n; i++)
+            if(counted(i))
+                others[digram((symbol)s[i], (symbol)s[i + 1])]++;
+
+        for(const auto& x : others)
+            if(x.second >= least)
+                h[{ x.first.first, x.first.second }] = x.second;
+
+        for(size_t i = 0; i + 1 < n; i++) {
+            if(other(i)) {
+                auto k = others.find(digram((symbol)s[i], (symbol)s[i + 1]));
+                frequent[i] = k != others.end() and k->second >= least;
+            }
         }
+    }
+
+    estimates.reset();
+
+    // the n-grams of 3 or more symbols from i to j with all their digrams
+    // frequent, and the gapped pairs from i to j with an end that is not a
+    // byte. like the pairs they go through a pz_sketch first when there are
+    // more of them than the budget could count exactly
+
+    auto ngrams = [&](const std::function<void(size_t, size_t)>& f) {
+        for(size_t i = 0; i + 2 < n; i++)
+            for(size_t j = i + 1; j < n and j - i < maxlen and frequent[j - 1]; j++)
+                if(j - i >= 2)
+                    f(i, j);
+    };
+
+    auto gapped_pairs = [&](const std::function<void(size_t, size_t)>& f) {
+        if(gaps != 0)
+            for(size_t i = 0; i + 2 < n; i++)
+                for(size_t j = i + 2; j < n and j - i < maxlen and byte(s[j - 1]); j++)
+                    if(not byte(s[i]) or not byte(s[j]))
+                        f(i, j);
+    };
+
+    auto ngram_key = [&s](size_t i, size_t j) -> uint64_t {
+        uint64_t x = j - i;
+        for(size_t k = i; k <= j; k++)
+            x = (x ^ (uint32_t)s[k]) * 0x100000001b3ULL;
+        return x;
+    };
 
-        const size_t minlen2 = 2;
-        block key2;
+    auto gapped_key = [&s](size_t i, size_t j) -> uint64_t {
+        return (((uint64_t)(j - i) << 56 | 1ULL << 55) ^ (uint64_t)(uint32_t)s[i] << 24 ^ (uint32_t)s[j]) * 0x9e3779b97f4a7c15ULL;
+    };
 
-        key2.push_back(*iter);
+    if(sketch != 0) {
 
-        for(auto jter = next(iter); jter != b.end() and key2.size() < maxlen; jter++) {
+        size_t grams = 0;
 
-            key2.push_back(*jter);
+        ngrams([&](size_t, size_t) { grams++; });
+        gapped_pairs([&](size_t, size_t) { grams++; });
 
-            if(key2.size() >= minlen2)
-                h[key2]++;
+        if(grams * pz_ngram_entry > sketch) {
+            estimates.reset(new pz_sketch(sketch));
+            ngrams([&](size_t i, size_t j) { estimates->add(ngram_key(i, j)); });
+            gapped_pairs([&](size_t i, size_t j) { estimates->add(gapped_key(i, j)); });
+        }
+    }
 
-            key2.back() = symbol::wildcard;
+    ngrams([&](size_t i, size_t j) {
+        if(estimates == nullptr or estimates->estimate(ngram_key(i, j)) >= least) {
+            block key;
+            for(size_t k = i; k <= j; k++)
+                key.push_back((symbol)s[k]);
+            h[key]++;
+        }
+    });
+
+    if(gaps == 0)
+        return h;
+
+    for(size_t g = 1; g <= gaps; g++) {
+        for(size_t k = 0; k < counts[g].size(); k++) {
+            if(counts[g][k] >= least) {
+                block key(g + 2, symbol::wildcard);
+                key.front() = (symbol)(k >> 8);
+                key.back() = (symbol)(k & 0xff);
+                h[key] = counts[g][k];
+            }
         }
     }
 
+    gapped_pairs([&](size_t i, size_t j) {
+        if(estimates == nullptr or estimates->estimate(gapped_key(i, j)) >= least) {
+            block key(j - i + 1, symbol::wildcard);
+            key.front() = (symbol)s[i];
+            key.back() = (symbol)s[j];
+            h[key]++;
+        }
+    });
+
     return h;
 }
 
-meta<block> pz_get_block(int fd) {
+meta<block> pz_get_block(int fd, size_t window, int latency, bool& eof, uint32_t& check) {
+
+    // read up to window bytes, window 0 meaning until end of file. with a latency,
+    // a partial window is returned once its first byte has waited latency msec.
+    // check is the crc32c of the bytes read, computed as they come in
+
+    using clock = std::chrono::steady_clock;
+
     block b;
 
     unsigned char buf[1024];
-    int n;
+    ssize_t n;
 
-    do {
-        n = read(fd, buf, sizeof(buf));
-        if(n == -1) {
-            if(errno == EAGAIN)
-                continue;
-            return meta<block>(false,block());
-        }
+    clock::time_point deadline;
 
-        for(int i = 0; i < n; i++)
-            b.push_back((symbol)buf[i]);
+    eof = false;
+    check = 0;
 
-    } while(n != 0);
+    while(window == 0 or b.size() < window) {
 
-    return meta<block>(true,b);
-}
+        if(latency > 0) {
 
-size_t pz_expand_singletons(block& b, dictionary& d, metric<symbol>& sh) {
+            int timeout = -1;
 
-    size_t n = 0;
+            if(not b.empty()) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now());
+                timeout = std::max<int>(0, left.count());
+            }
 
-	auto pos = b.begin();
+            struct pollfd pfd = { fd, POLLIN, 0 };
 
-    while(pos != b.end()) {
+            int m = poll(&pfd, 1, timeout);
 
-        auto sym = *pos;
+            if(m == -1) {
+                if(errno == EINTR)
+                    continue;
+                return meta<block>(false,block());
+            }
 
-        if(sym >= symbol::first and sh[sym] == 1) {
+            if(m == 0)
+                break;
+        }
 
-            const auto& seq = d[sym];
+        size_t want = sizeof(buf);
 
-            pos = b.erase(pos);
-			pos = std::prev(pos);
-            b.insert(std::next(pos), seq.cbegin(), seq.cend());
+        if(window != 0)
+            want = std::min(want, window - b.size());
 
-            n++;
+        n = read(fd, buf, want);
 
-        } else {
+        if(n == -1) {
+            if(errno == EAGAIN or errno == EINTR)
+                continue;
+            return meta<block>(false,block());
+        }
 
-            pos++;
+        if(n == 0) {
+            eof = true;
+            break;
         }
+
+        if(b.empty())
+            deadline = clock::now() + std::chrono::milliseconds(latency);
+
+        check = pz_crc32c(check, buf, n);
+
+        for(ssize_t i = 0; i < n; i++)
+            b.push_back((symbol)buf[i]);
     }
 
-    return n;
+    return meta<block>(true,b);
 }
 
-size_t pz_expand_singletons(dictionary& d, metric<symbol>& sh) {
+ssize_t pz_read(int fd, void *p, size_t sz) {
 
-    size_t n = 0;
+    char *q = (char *)p;
 
-    for(auto& rule : d) {
-        block b(rule.second.begin(), rule.second.end());
-        n += pz_expand_singletons(b, d, sh);
-        rule.second = block(b.begin(), b.end());
+    size_t done = 0;
+
+    while(done < sz) {
+        ssize_t n = read(fd, q + done, sz - done);
+        if(n == 0)
+            break;
+        if(n == -1) {
+            if(errno == EINTR or errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        done += n;
     }
 
-    return n;
+    return done;
 }
 
-size_t pz_expand_singletons(block& b, dictionary& d) {
-    auto sh = pz_symbol_histogram(b,d);
-    return pz_expand_singletons(b, d, sh) + pz_expand_singletons(d, sh);
-}
+template <typename T> bool pz_read_vector(int fd, std::vector<T>& v, uint64_t n) {
 
-void pz_trim_dictionary(const block& b, dictionary& d) {
+    // reads n elements a window at a time, so that a corrupt count runs
+    // out of input before it runs out of memory
 
-    auto sh = pz_symbol_histogram(b,d);
+    v.clear();
 
-    auto iter = d.begin();
+    while(v.size() < n) {
 
-    while(iter != d.end()) {
-        if(sh.find(iter->first) == sh.end())
-            iter = d.erase(iter);
-        else
-            iter++;
+        const size_t m = v.size();
+        const size_t k = std::min<uint64_t>(n - m, pz_stream_window / sizeof(T));
+
+        v.resize(m + k);
+
+        if(pz_read(fd, v.data() + m, k * sizeof(T)) != (ssize_t)(k * sizeof(T)))
+            return false;
     }
+
+    return true;
 }
 
 void write_utf8(unsigned int code_point) {
@@ -299,253 +729,2304 @@ void write_utf8(unsigned int code_point) {
     }
 }
 
-metric<symbol> pz_symbol_histogram(const block& b, const dictionary& d) {
+void pz_forget_rule(rdictionary& r, const dictionary& d, symbol x) {
 
-    metric<symbol> h;
+    // rules are only reachable through r while their body is still
+    // the digram they were created from
 
-    for(symbol x : b)
-        if(x >= symbol::first)
-            h[x]++;
+    const block& seq = d.at(x);
 
-    for(const auto& r : d)
-        for(symbol x : r.second)
-            if(x >= symbol::first)
-                h[x]++;
+    if(seq.size() == 2) {
+        auto kter = r.find(digram(seq.front(), seq.back()));
+        if(kter != r.end() and kter->second == x)
+            r.erase(kter);
+    }
+}
 
-    return h;
+void pz_inline_rule(dictionary& d, rdictionary& r, census& c, symbol x) {
+
+    // x is used exactly once, inside the body of rule c.parent(x),
+    // so splice its body in there and release x
+
+    const symbol t = c.parent(x);
+
+    block& seq = d.at(x);
+    block& parent = d.at(t);
+
+    pz_forget_rule(r, d, x);
+    pz_forget_rule(r, d, t);
+
+    for(symbol y : seq) {
+        c.disown(d, y, x);
+        c.adopt(d, y, t);
+    }
+
+    c.disown(d, x, t);
+
+    auto pos = std::find(parent.begin(), parent.end(), x);
+    pos = parent.erase(pos);
+    parent.splice(pos, seq);
+
+    d.erase(x);
+}
+
+block::iterator pz_expand_rule(block& b, block::iterator pos, const block& body) {
+
+    // replaces the rule at pos by its body, each wildcard taking the next
+    // argument in place, and returns where the body starts
+
+    pos = b.erase(pos);
+
+    auto first = pos;
+    bool start = true;
+
+    for(symbol x : body) {
+
+        if(x != symbol::wildcard) {
+            auto iter = b.insert(pos, x);
+            if(start)
+                first = iter;
+        } else if(pos == b.end()) {
+            throw std::runtime_error("pz_expand_rule(): missing argument");
+        } else {
+            if(pz_is_argument(*pos))
+                *pos = pz_literal(*pos);
+            if(start)
+                first = pos;
+            pos++;
+        }
+
+        start = false;
+    }
+
+    return first;
 }
 
-void pz_expand(block& b, const dictionary& d) {
+void pz_expand(block& b, const dictionary& d, const pz_shared_rules& shared) {
 
     auto iter = b.begin();
 
     while(iter != b.end()) {
         symbol x = *iter;
         const auto rule = d.find(x);
-        if(rule == d.end()) {
-            iter++;
+        if(rule != d.end()) {
+            iter = pz_expand_rule(b, iter, rule->second);
+        } else if(shared.contains(x)) {
+            block bytes;
+            for(size_t n = 0; n < shared.length(x); n++)
+                bytes.push_back((symbol)shared.expansion(x)[n]);
+            iter = pz_expand_rule(b, iter, bytes);
         } else {
-            iter = b.erase(iter);
-			iter = std::prev(iter);
-            b.insert(std::next(iter), rule->second.begin(), rule->second.end());
+            iter++;
         }
     }
 }
 
-void pz_remap(block& b, dictionary& d) {
+std::vector<uint64_t> pz_expansion_lengths(const dictionary& d, const pz_shared_rules& shared) {
 
-    std::map<symbol,symbol> remap;
+    // what each rule expands to, wildcards left out, worked out before
+    // expanding anything so that a corrupt grammar, with a rule inside
+    // itself or a rule that is not defined, throws instead of expanding
+    // without end. shared rules are not in d and have their lengths already
 
-    symbol current = symbol::first;
+    constexpr uint64_t limit = uint64_t(1) << 62;
 
-    for(const auto& rule : d)
-        if(rule.first >= symbol::first)
-            remap[rule.first] = current++;
+    std::vector<uint64_t> lengths(d.extent(), 0);
+    std::vector<uint8_t> visited(d.extent(), 0);
 
-    for(symbol& x : b)
-        if(x >= symbol::first)
-            x = remap.at(x);
+    std::function<uint64_t(symbol)> length = [&](symbol x) -> uint64_t {
 
-    dictionary e;
+        if(x < symbol::first)
+            return x == symbol::wildcard ? 0 : 1;
 
-    for(const auto& rule : d) {
+        if(shared.contains(x))
+            return shared.length(x);
 
-        symbol x = rule.first;
-        block s = rule.second;
+        if(not d.contains(x))
+            throw std::runtime_error("corrupt dictionary");
 
-        for(auto iter = s.begin(); iter != s.end(); ++iter)
-            if(*iter >= symbol::first)
-                *iter = remap.at(*iter);
+        const size_t n = dictionary::index(x);
 
-        e[remap.at(x)] = s;
-    }
+        if(visited[n] == 1)
+            throw std::runtime_error("corrupt dictionary");
 
-    d = e;
-}
+        if(visited[n] == 0) {
 
-std::set<block> pz_get_ngrams(const block& b) {
+            visited[n] = 1;
 
-    const size_t block_maxlen = 2;
-    const size_t multiplicity = 4;
+            for(symbol y : d.at(x))
+                lengths[n] = std::min(limit, lengths[n] + length(y));
 
-    auto measurement_comparison = [](const measurement& a, const measurement& b) -> bool {
-        return b.second > a.second;
+            visited[n] = 2;
+        }
+
+        return lengths[n];
     };
 
-    auto h = pz_get_histogram(b, block_maxlen);
+    for(const auto& rule : d)
+        length(rule.first);
 
-    const auto& max_measurement = std::max_element(h.begin(), h.end(), measurement_comparison);
+    return lengths;
+}
 
-    if(max_measurement == h.end() or max_measurement->second < multiplicity)
-        return std::set<block>();
+pz_short_rules pz_get_short_rules(const dictionary& d, const pz_shared_rules& shared, const std::vector<uint64_t>& lengths) {
 
-    std::set<block> ngrams;
+    pz_short_rules s;
 
-    for(const auto& m : h)
-        if(m.second >= multiplicity)
-            ngrams.insert(m.first);
+    size_t total = 0;
 
-    return ngrams;
-}
+    for(const auto& rule : d)
+        if(lengths[dictionary::index(rule.first)] <= pz_short_copy)
+            total += lengths[dictionary::index(rule.first)];
 
-bool pz_process_fd(const config&, int fdin, int fdout) {
+    s.offsets.assign(d.extent(), pz_short_rules::none);
+    s.sizes.assign(d.extent(), 0);
+    s.table.resize(total + pz_short_copy);
 
-    auto print_info = [](const block& bl, const dictionary& di) {
+    size_t used = 0;
 
-        size_t k = 0;
+    // a rule built before the rules of its body walks them. gapped
+    // rules are only used with arguments and stay out
 
-        for(const auto& r : di)
-            k += r.second.size() + 1;
+    for(const auto& rule : d) {
 
-        std::cerr << "document: " << bl.size() << " symbols ~ ";
-        std::cerr << "dictionary: " << di.size() << " rules ";
-        std::cerr << k << " symbols = " << (k + bl.size()) << " total symbols" << std::endl;
-    };
+        const size_t n = dictionary::index(rule.first);
 
-    symbol current_symbol = symbol::first;
+        if(lengths[n] > pz_short_copy)
+            continue;
 
-    meta<block> mb = pz_get_block(fdin);
+        if(std::count(rule.second.begin(), rule.second.end(), symbol::wildcard) != 0)
+            continue;
 
-    if(!mb.first) {
-        std::cerr << strerror(errno) << std::endl;
-        return false;
-    }
+        const symbol *args = nullptr;
 
-    block b = mb.second;
+        pz_expand_into(d, shared, s, rule.first, s.table.data() + used, s.table.data() + s.table.size(), args);
 
-    dictionary d;
+        s.offsets[n] = used;
+        s.sizes[n] = lengths[n];
 
-    std::cerr << " : " << b.size() << " symbols" << std::endl;
+        used += lengths[n];
+    }
 
-    rdictionary r;
+    return s;
+}
 
-    std::set<block> ngrams;
+uint8_t *pz_expand_into(const dictionary& d, const pz_shared_rules& shared, const pz_short_rules& s, symbol x, uint8_t *p, const uint8_t *end, const symbol *& args) {
 
-    while(not (ngrams = pz_get_ngrams(b)).empty()) {
+    // writes the expansion of x at p, wildcards taking the next arguments.
+    // short rules are copied from the table and shared rules from the
+    // mapped dictionary, whose padding allows over-copying like the table
 
-        auto bpos = b.begin();
+    if(x < symbol::first) {
+        *p++ = (uint8_t)x;
+        return p;
+    }
 
-        while(next(bpos) != b.end()) {
+    if(shared.contains(x)) {
 
-            const block x = { *bpos, *next(bpos) };
+        const size_t k = shared.length(x);
+        const uint8_t *q = shared.expansion(x);
 
-            if(ngrams.find(x) == ngrams.end()) {
+        if(k <= pz_short_copy and end - p >= (ptrdiff_t)pz_short_copy)
+            pz_copy_short(p, q, k);
+        else
+            memcpy(p, q, k);
 
-                bpos++;
+        return p + k;
+    }
 
-            } else {
+    const size_t n = dictionary::index(x);
 
-                symbol s;
-                auto kter = r.find(x);
+    if(s.offsets[n] != pz_short_rules::none) {
 
-                if(kter == r.end()) {
+        const uint8_t *q = s.table.data() + s.offsets[n];
 
-                    s = current_symbol;
-                    d[current_symbol] = x;
-                    r[x] = current_symbol++;
+        if(end - p >= (ptrdiff_t)pz_short_copy)
+            pz_copy_short(p, q, s.sizes[n]);
+        else
+            memcpy(p, q, s.sizes[n]);
 
-                } else {
+        return p + s.sizes[n];
+    }
 
-                    s = kter->second;
-                }
+    for(symbol y : d.at(x)) {
+        if(y == symbol::wildcard)
+            *p++ = (uint8_t)pz_literal(*args++);
+        else
+            p = pz_expand_into(d, shared, s, y, p, end, args);
+    }
 
-                bpos = pz_erase_block(b, bpos, x);
-                bpos = b.insert(bpos, s);
-            }
-        }
+    return p;
+}
 
-        print_info(b, d);
-    }
+uint32_t pz_expand_parallel(const std::vector<symbol>& doc, const dictionary& d, const pz_shared_rules& shared, uint64_t length, std::vector<uint8_t>& bytes) {
 
-    pz_expand_singletons(b, d);
-    pz_trim_dictionary(b, d);
-    pz_remap(b, d);
-    print_info(b, d);
+    // a running sum of the expanded lengths gives where each symbol of doc
+    // starts in the output. doc is cut into one slice per thread at about
+    // equal output offsets, never between a gapped rule and its arguments,
+    // and each thread expands its slice in place and takes its crc32c,
+    // which are then combined. only the offsets of the cuts are kept.
+    // returns the crc32c of the whole
 
-    //
-    // output
-    //
+    const auto lengths = pz_expansion_lengths(d, shared);
 
-    auto rule_comparison = [](const dictionary_rule& a, const dictionary_rule& b) {
-        return b.first > a.first;
-    };
+    const size_t threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), length >> 20));
 
-    const auto& max_rule = std::max_element(d.begin(), d.end(), rule_comparison);
+    std::vector<size_t> cuts(threads + 1, doc.size());
+    std::vector<uint64_t> starts(threads + 1, 0);
 
-    if(max_rule->first >= symbol::max_16bit)
-        throw std::runtime_error("maximum symbol too big for now.");
+    cuts[0] = 0;
 
-    for(const dictionary_rule& rule : d) {
+    uint64_t offset = 0;
+    size_t next = 1;
 
-        uint16_t x = (uint16_t)rule.first;
-        int16_t y = (int16_t)symbol::wildcard;
+    for(size_t n = 0; n < doc.size(); n++) {
 
-        if(write(fdout, &x, sizeof(x)) != sizeof(x))
-            throw std::runtime_error("write(rule.first) failed");
+        const symbol x = doc[n];
 
-        for(symbol s : rule.second) {
-            x = (uint16_t)s;
-            if(write(fdout, &x, sizeof(x)) != sizeof(x))
-                throw std::runtime_error("write(rule.second) failed");
+        while(next < threads and offset >= length / threads * next and not pz_is_argument(x)) {
+            cuts[next] = n;
+            starts[next++] = offset;
         }
 
-        if(write(fdout, &y, sizeof(y)) != sizeof(y))
-            throw std::runtime_error("write(symbol::wildcard) failed");
-    }
+        uint64_t k = 1;
 
-    for(symbol s : b) {
-        uint16_t x = (uint16_t)s;
-        if(write(fdout, &x, sizeof(x)) != sizeof(x))
-            throw std::runtime_error("write(block) failed");
+        if(shared.contains(x))
+            k = shared.length(x);
+        else if(x >= symbol::first and not d.contains(x))
+            throw std::runtime_error("corrupt document");
+        else if(x >= symbol::first)
+            k = lengths[dictionary::index(x)];
+
+        offset = std::min<uint64_t>(uint64_t(1) << 62, offset + k);
     }
 
-    //
-    // test correctness
-    //
+    if(offset != length)
+        throw std::runtime_error("frame length mismatch");
 
-    pz_expand(b,d);
+    while(next <= threads)
+        starts[next++] = offset;
 
-    if(b != mb.second)
-        throw std::runtime_error("1st expansion test failed.");
+    const auto shorts = pz_get_short_rules(d, shared, lengths);
 
-    return true;
-}
+    // the padding lets the last slice over-copy up to its end
 
-bool pz_process_file(const config& cfg, const char *filenamein) {
+    bytes.resize(length + pz_short_copy);
 
-    int fdin;
-    int fdout;
-    struct stat sb;
+    std::vector<uint32_t> checks(threads, 0);
 
-    std::cerr << std::setw(12) << filenamein << ": ";
+    auto expand = [&](size_t t) {
 
-    if(lstat(filenamein, &sb) == -1) {
-        std::cerr << strerror(errno) << std::endl;
-        return false;
-    }
+        uint8_t *p = bytes.data() + starts[t];
+        uint8_t *q = p;
 
-    if(S_ISDIR(sb.st_mode)) {
-        std::cerr << "ignoring directory" << std::endl;
-        return false;
-    }
+        const uint8_t *end = (t + 1 == threads) ? bytes.data() + bytes.size() : bytes.data() + starts[t + 1];
 
-    if(cfg.stdoutput) {
+        for(size_t n = cuts[t]; n < cuts[t + 1]; ) {
 
-        // if output is standard output then
-        // input type doesnt matter
-        // as long as it can be read
+            const symbol *args = doc.data() + n + 1;
 
-        fdout = STDOUT_FILENO;
+            q = pz_expand_into(d, shared, shorts, doc[n], q, end, args);
 
-    } else {
+            n = args - doc.data();
+        }
 
-        // if output is not standard output
-        // then only compress regular files
+        checks[t] = pz_crc32c(0, p, q - p);
+    };
 
-        if(not S_ISREG(sb.st_mode)) {
-            std::cerr << "ignoring " << get_file_type(sb) << std::endl;
-            return false;
-        }
+    std::vector<std::thread> workers;
+
+    for(size_t t = 1; t < threads; t++)
+        workers.emplace_back(expand, t);
+
+    expand(0);
+
+    for(auto& worker : workers)
+        worker.join();
+
+    uint32_t check = checks[0];
+
+    for(size_t t = 1; t < threads; t++)
+        check = pz_crc32c_combine(check, checks[t], starts[t + 1] - starts[t]);
+
+    return check;
+}
+
+void pz_remap(block& b, dictionary& d) {
+
+    // rules are renumbered densely so that each body only names lower
+    // rules and, of the rules whose body is ready, the most used comes
+    // first. the hottest rules get the lowest symbols and a decoder can
+    // build every rule in one forward pass. shared rules are not in d
+
+    std::vector<size_t> uses(d.extent(), 0);
+    std::vector<size_t> waiting(d.extent(), 0);
+    std::vector<std::vector<symbol>> users(d.extent());
+
+    auto used = [&](symbol x) -> bool {
+        return x >= symbol::first and d.contains(x);
+    };
+
+    for(symbol x : b)
+        if(used(x))
+            uses[dictionary::index(x)]++;
+
+    for(const auto& rule : d) {
+        for(symbol x : rule.second) {
+            if(used(x)) {
+                uses[dictionary::index(x)]++;
+                waiting[dictionary::index(rule.first)]++;
+                users[dictionary::index(x)].push_back(rule.first);
+            }
+        }
+    }
+
+    std::vector<symbol> order;
+
+    using ready_rule = std::pair<size_t,int>;
+
+    std::priority_queue<ready_rule> ready;
+
+    for(const auto& rule : d)
+        if(waiting[dictionary::index(rule.first)] == 0)
+            ready.push({ uses[dictionary::index(rule.first)], -(int)rule.first });
+
+    while(not ready.empty()) {
+
+        const symbol x = (symbol)-ready.top().second;
+
+        ready.pop();
+        order.push_back(x);
+
+        for(symbol y : users[dictionary::index(x)])
+            if(--waiting[dictionary::index(y)] == 0)
+                ready.push({ uses[dictionary::index(y)], -(int)y });
+    }
+
+    if(order.size() != d.size())
+        throw std::runtime_error("pz_remap(): rules used within themselves");
+
+    const auto remap = d.reorder(order);
+
+    auto rename = [&remap](symbol& x) {
+        if(x >= symbol::first and dictionary::index(x) < remap.size())
+            x = remap[dictionary::index(x)];
+    };
+
+    for(symbol& x : b)
+        rename(x);
+
+    for(auto& rule : d)
+        for(symbol& x : rule.second)
+            rename(x);
+}
+
+bool pz_frozen(const dictionary& d, symbol x) {
+
+    // arguments and the gapped rules they follow take no part in other rules,
+    // so a gapped rule is only ever used in the document
+
+    if(pz_is_argument(x))
+        return true;
+
+    const auto rule = d.find(x);
+
+    return rule != d.end() and std::count(rule->second.begin(), rule->second.end(), symbol::wildcard) != 0;
+}
+
+void pz_rule_lengths(const dictionary& d, const pz_shared_rules& shared, pz_block_stats *bs) {
+
+    std::vector<size_t> expanded(d.extent(), 0);
+
+    std::function<size_t(symbol)> length = [&](symbol x) -> size_t {
+
+        if(shared.contains(x))
+            return shared.length(x);
+
+        if(not d.contains(x))
+            return 1;
+
+        size_t& n = expanded[dictionary::index(x)];
+
+        if(n == 0)
+            for(symbol y : d.at(x))
+                n += length(y);
+
+        return n;
+    };
+
+    for(const auto& rule : d) {
+        bs->rule_lengths[rule.second.size()]++;
+        bs->expansion_lengths[length(rule.first)]++;
+    }
+}
+
+long pz_gain(const measurement& m) {
+
+    // in bytes. a rule costs its body plus two symbols and saves all but
+    // one symbol of each use of the n-gram it replaces. a gapped rule
+    // costs two symbols more for its gap, each use of it keeps one
+    // argument byte per wildcard
+
+    const long n = m.first.size();
+    const long gap = std::count(m.first.begin(), m.first.end(), symbol::wildcard);
+    const long uses = m.second;
+
+    if(gap == 0)
+        return 2 * (uses * (n - 1) - (n + 2));
+
+    return uses * (2 * n - 2 - gap) - 2 * (n - gap + 4);
+}
+
+histogram pz_get_ngrams(const config& cfg, const block& b, const dictionary& d, const pz_profile& profile, bool gapped, pz_round_stats& rs) {
+
+    const size_t block_maxlen = profile.maxlen;
+    const size_t multiplicity = profile.multiplicity;
+
+    auto measurement_comparison = [](const measurement& a, const measurement& b) -> bool {
+        return b.second > a.second;
+    };
+
+    // n-grams are counted in the document and, apart from gapped ones, in
+    // the bodies of rules longer than any n-gram, each after an argument
+    // symbol that no n-gram can take
+
+    std::vector<symbol> seq(b.begin(), b.end());
+
+    if(not gapped) {
+        for(const auto& rule : d) {
+            if(rule.second.size() > block_maxlen) {
+                seq.push_back(symbol::argument);
+                seq.insert(seq.end(), rule.second.begin(), rule.second.end());
+            }
+        }
+    }
+
+    auto h = pz_get_histogram(seq, block_maxlen, gapped, multiplicity, cfg.sketch, cfg.sort);
+
+    rs.histogram = h.size();
+
+    const auto& max_measurement = std::max_element(h.begin(), h.end(), measurement_comparison);
+
+    if(max_measurement == h.end() or max_measurement->second < multiplicity)
+        return histogram();
+
+    histogram ngrams;
+
+    auto frozen = [&d](const measurement& m) -> bool {
+        for(symbol x : m.first)
+            if(pz_frozen(d, x))
+                return true;
+        return false;
+    };
+
+    for(const auto& m : h)
+        if(m.second >= multiplicity and pz_gain(m) > 0 and not frozen(m))
+            ngrams.insert(m);
+
+    rs.candidates = ngrams.size();
+
+    return ngrams;
+}
+
+pz_probe pz_probe_block(const block& b) {
+
+    pz_probe probe;
+
+    if(b.size() < pz_probe_minimum)
+        return probe;
+
+    std::vector<size_t> bytes(256, 0);
+    std::vector<uint16_t> digrams(1 << 16, 0);
+
+    size_t sampled = 0;
+    size_t repeated = 0;
+
+    const size_t windows = std::min(pz_probe_windows, (b.size() + pz_probe_window - 1) / pz_probe_window);
+    const size_t stride = b.size() / windows;
+
+    auto pos = b.begin();
+    size_t at = 0;
+
+    for(size_t w = 0; w < windows; w++) {
+
+        std::advance(pos, w * stride - at);
+        at = w * stride;
+
+        auto iter = pos;
+        unsigned prev = (unsigned)*iter & 0xff;
+
+        bytes[prev]++;
+
+        for(size_t n = 1; n < pz_probe_window and ++iter != b.end(); n++) {
+
+            const unsigned x = (unsigned)*iter & 0xff;
+
+            bytes[x]++;
+
+            uint16_t& k = digrams[(prev << 8) | x];
+
+            if(++k == pz_probe_multiplicity)
+                repeated += k;
+            else if(k > pz_probe_multiplicity)
+                repeated++;
+
+            sampled++;
+            prev = x;
+        }
+    }
+
+    const double total = std::accumulate(bytes.begin(), bytes.end(), 0.0);
+
+    for(size_t n : bytes)
+        if(n > 0)
+            probe.entropy -= n / total * std::log2(n / total);
+
+    probe.repeats = sampled ? (double)repeated / sampled : 0;
+
+    if(probe.entropy > 7.5 and probe.repeats < 0.1)
+        probe.mode = pz_mode::store;
+    else if(probe.entropy > 6.5 or probe.repeats < 0.5)
+        probe.mode = pz_mode::cheap;
+
+    return probe;
+}
+
+void pz_store_block(const block& b, uint32_t check, pz_writer& out, pz_block_stats *bs) {
+
+    pz_frame frame;
+
+    frame.length = b.size();
+    frame.size = b.size();
+    frame.flags = pz_frame_crc32c | pz_frame_stored;
+    frame.check = check;
+
+    out.put(frame);
+
+    for(symbol x : b)
+        out.put((uint8_t)x);
+
+    if(bs != nullptr)
+        bs->output = sizeof(frame) + frame.size;
+}
+
+void pz_print_grammar(const config& cfg, const block& b, const dictionary& d) {
+
+    size_t k = 0;
+
+    for(const auto& r : d)
+        k += r.second.size() + 1;
+
+    *cfg.log << "document: " << b.size() << " symbols ~ ";
+    *cfg.log << "dictionary: " << d.size() << " rules ";
+    *cfg.log << k << " symbols = " << (k + b.size()) << " total symbols" << std::endl;
+}
+
+pz_shared_rules pz_share(const config& cfg) {
+
+    // the shared dictionary, if any, as the encoder numbers it. a block
+    // makes fewer rules than it has symbols, so they never reach its first
+
+    pz_shared_rules shared;
+
+    shared.mapped = cfg.dictionary;
+    shared.first = (symbol)(1 << 30);
+
+    return shared;
+}
+
+void pz_induce(const config& cfg, block& b, dictionary& d, const pz_profile& profile, pz_block_stats *bs) {
+
+    // rewrites b into the document of a grammar whose rules end up in d,
+    // numbered densely. rules of the shared dictionary are left out of d
+
+    auto print_info = [&cfg](const block& bl, const dictionary& di) {
+        pz_print_grammar(cfg, bl, di);
+    };
+
+    rdictionary r;
+    std::map<block,symbol> longer;
+    census c;
+
+    std::vector<symbol> recycled;
+    std::vector<symbol> released;
+    std::vector<symbol> pending;
+    std::vector<symbol> bodies;
+
+    histogram ngrams;
+
+    size_t round = 0;
+    size_t size = SIZE_MAX;
+
+    pz_round_stats rs;
+
+    //
+    // with a shared dictionary the input is first parsed into the longest
+    // expansions of its rules. they can be reused as digrams, looked up in
+    // its pair hash, and take part in new rules, but as they are not in d
+    // they are never counted, inlined or released
+    //
+
+    const pz_shared_rules shared = pz_share(cfg);
+
+    if(shared.mapped != nullptr) {
+
+        pz_phase phase(bs, "share");
+
+        std::vector<uint8_t> bytes;
+
+        bytes.reserve(b.size());
+
+        for(symbol x : b)
+            bytes.push_back((uint8_t)x);
+
+        b.clear();
+
+        for(size_t n = 0; n < bytes.size(); ) {
+
+            uint16_t x;
+
+            const size_t k = shared.mapped->match(bytes.data() + n, bytes.size() - n, &x);
+
+            if(k == 0) {
+                b.push_back((symbol)bytes[n++]);
+            } else {
+                b.push_back(shared.first + (x - (int)symbol::first));
+                n += k;
+            }
+        }
+
+        print_info(b, d);
+    }
+
+    auto new_rule = [&](const block& x) -> symbol {
+
+        symbol s;
+
+        if(recycled.empty()) {
+            s = d.next_key();
+        } else {
+            s = recycled.back();
+            recycled.pop_back();
+        }
+
+        if(s >= shared.first)
+            throw std::runtime_error("maximum symbol too big for now.");
+
+        d[s] = x;
+
+        if(x.size() == 2)
+            r[digram(x.front(), x.back())] = s;
+        else
+            longer[x] = s;
+
+        c.reserve(d);
+        c.enter(s, round);
+
+        for(symbol y : x)
+            c.adopt(d, y, s);
+
+        rs.created++;
+
+        return s;
+    };
+
+    //
+    // each round replaces the frequent digrams and, in the same scan, inlines
+    // rules from earlier rounds that are down to a single use in the document.
+    // rules left used once inside another rule are inlined at the end of the
+    // round. released symbols are reused from the next round on, once they
+    // can no longer appear in that round's ngrams. the last round only inlines,
+    // or is one that replaced nothing or did not shrink the grammar. rules
+    // longer than a digram are only looked up within the round that made
+    // them, their n-gram is gone from the document once the round is over.
+    //
+
+    if(profile.repeats > 0) {
+
+        pz_phase phase(bs, "repeats");
+
+        // shared rules are brought down to follow the rules of the block,
+        // so that the alphabet stays small
+
+        const int32_t top = (int32_t)d.next_key();
+
+        auto down = [&](symbol x) -> int32_t {
+            return shared.contains(x) ? top + (int32_t)shared.index(x) : (int32_t)x;
+        };
+
+        auto up = [&](int32_t x) -> symbol {
+            return x >= top ? shared.first + (x - top) : (symbol)x;
+        };
+
+        std::vector<int32_t> seq;
+
+        seq.reserve(b.size());
+
+        for(symbol x : b)
+            seq.push_back(down(x));
+
+        const auto repeats = pz_maximal_repeats(seq, top + (int32_t)shared.size(), profile.repeats, profile.multiplicity);
+
+        // rebuild the document with each picked occurrence replaced
+
+        std::vector<symbol> starts(seq.size(), symbol::wildcard);
+
+        for(const pz_repeat& x : repeats) {
+
+            block body;
+
+            for(size_t n = 0; n < x.length; n++)
+                body.push_back(up(seq[x.positions.front() + n]));
+
+            const symbol s = new_rule(body);
+
+            for(size_t p : x.positions)
+                starts[p] = s;
+        }
+
+        b.clear();
+
+        for(size_t n = 0; n < seq.size(); ) {
+            if(starts[n] == symbol::wildcard) {
+                b.push_back(up(seq[n++]));
+            } else {
+                b.push_back(starts[n]);
+                c.cite(d, starts[n]);
+                n += d.at(starts[n]).size();
+            }
+        }
+
+        print_info(b, d);
+    }
+
+    pz_phase induce(bs, "induce");
+
+    do {
+
+        pz_clock start;
+        size_t allocated = 0;
+
+        rs = pz_round_stats();
+        rs.round = round;
+
+        if(bs != nullptr) {
+            start = pz_clock::now();
+            allocated = pz_heap::allocated();
+        }
+
+        bool gapped = false;
+
+        if(profile.rounds != 0 and round >= profile.rounds) {
+            ngrams.clear();
+        } else {
+            ngrams = pz_get_ngrams(cfg, b, d, profile, false, rs);
+            if(ngrams.empty() and profile.gapped) {
+                ngrams = pz_get_ngrams(cfg, b, d, profile, true, rs);
+                gapped = true;
+            }
+        }
+
+        bodies.clear();
+
+        for(const auto& rule : d)
+            if(rule.second.size() > profile.maxlen)
+                bodies.push_back(rule.first);
+
+        longer.clear();
+
+        recycled.insert(recycled.end(), released.begin(), released.end());
+        released.clear();
+
+        // scans the document, or with an owner the body of that rule, which
+        // takes no gapped rules and inlines none of its own
+
+        auto scan = [&](block& seq, symbol owner) {
+
+            const bool document = owner == symbol::wildcard;
+
+            auto bpos = seq.begin();
+
+            while(bpos != seq.end()) {
+
+                if(document and c.document_singleton(d, *bpos, round)) {
+
+                    const symbol x = *bpos;
+
+                    pz_forget_rule(r, d, x);
+
+                    for(symbol y : d.at(x)) {
+                        c.disown(d, y, x);
+                        c.cite(d, y);
+                    }
+
+                    c.uncite(d, x);
+
+                    bpos = pz_expand_rule(seq, bpos, d.at(x));
+
+                    d.erase(x);
+                    released.push_back(x);
+
+                    rs.inlined++;
+
+                    continue;
+                }
+
+                if(next(bpos) == seq.end())
+                    break;
+
+                // of the candidate n-grams starting here, the one saving the most.
+                // the ends of an n-gram whose inner symbols are all bytes can
+                // also make a gapped one
+
+                block x;
+                block key;
+                long best = 0;
+                bool gap = true;
+
+                auto jter = bpos;
+
+                while(key.size() < profile.maxlen and jter != seq.end() and not pz_frozen(d, *jter)) {
+
+                    key.push_back(*jter++);
+
+                    auto kter = ngrams.find(key);
+
+                    if(kter != ngrams.end() and pz_gain(*kter) > best) {
+                        best = pz_gain(*kter);
+                        x = key;
+                    }
+
+                    if(document and gapped and gap and key.size() >= 3) {
+
+                        block pair(key.size(), symbol::wildcard);
+
+                        pair.front() = key.front();
+                        pair.back() = key.back();
+
+                        kter = ngrams.find(pair);
+
+                        if(kter != ngrams.end() and pz_gain(*kter) > best) {
+                            best = pz_gain(*kter);
+                            x = pair;
+                        }
+                    }
+
+                    if(key.size() >= 2)
+                        gap = gap and key.back() < symbol::first;
+                }
+
+                if(x.empty()) {
+
+                    bpos++;
+
+                } else {
+
+                    symbol s;
+
+                    if(x.size() == 2) {
+
+                        auto kter = r.find(digram(x.front(), x.back()));
+
+                        const symbol z = (kter == r.end()) ? shared.pair(x.front(), x.back()) : symbol::wildcard;
+
+                        if(kter != r.end())
+                            s = kter->second;
+                        else if(z != symbol::wildcard)
+                            s = z;
+                        else
+                            s = new_rule(x);
+
+                    } else {
+
+                        auto kter = longer.find(x);
+
+                        s = (kter == longer.end()) ? new_rule(x) : kter->second;
+                    }
+
+                    for(symbol z : x) {
+                        if(document)
+                            c.uncite(d, z);
+                        else
+                            c.disown(d, z, owner);
+                        if(c.nested_singleton(d, z))
+                            pending.push_back(z);
+                    }
+
+                    if(document)
+                        c.cite(d, s);
+                    else
+                        c.adopt(d, s, owner);
+
+                    if(std::count(x.begin(), x.end(), symbol::wildcard) == 0) {
+
+                        bpos = pz_erase_block(seq, bpos, x);
+                        bpos = seq.insert(bpos, s);
+
+                    } else {
+
+                        // the gap stays behind the rule as its arguments
+
+                        *bpos++ = s;
+
+                        for(size_t n = 2; n < x.size(); n++, bpos++)
+                            *bpos = pz_argument(*bpos);
+
+                        bpos = seq.erase(bpos);
+                    }
+
+                    rs.replacements++;
+                }
+            }
+        };
+
+        // rules longer than any n-gram came from repeats, their bodies are
+        // scanned too. a body is moved out while it is scanned, as new rules
+        // may move the rule table
+
+        scan(b, symbol::wildcard);
+
+        for(symbol x : bodies) {
+            if(d.contains(x)) {
+                block seq = std::move(d.at(x));
+                scan(seq, x);
+                d.at(x) = std::move(seq);
+            }
+        }
+
+        for(symbol x : pending) {
+            if(c.nested_singleton(d, x)) {
+                pz_inline_rule(d, r, c, x);
+                released.push_back(x);
+                rs.inlined++;
+            }
+        }
+
+        pending.clear();
+
+        if(not ngrams.empty())
+            print_info(b, d);
+
+        if(bs != nullptr) {
+            rs.time = pz_clock::now() - start;
+            rs.allocated = pz_heap::allocated() - allocated;
+            rs.symbols = b.size();
+            rs.rules = d.size();
+            bs->rounds.push_back(rs);
+        }
+
+        round++;
+
+        // rules made from overlapping counts can end up used once and be
+        // inlined again in the next round, over and over. a round that does
+        // not shrink the grammar is the last
+
+        const size_t last = size;
+
+        size = b.size();
+
+        for(const auto& rule : d)
+            size += rule.second.size() + 1;
+
+        if(size >= last)
+            break;
+
+    } while(not ngrams.empty() and rs.replacements > 0);
+
+    induce.stop();
+
+    pz_phase remap(bs, "remap");
+
+    pz_remap(b, d);
+    print_info(b, d);
+}
+
+void pz_induce_best(const config& cfg, block& b, dictionary& d, const pz_profile& profile, pz_block_stats *bs) {
+
+    // b is induced with the profile and then with each of its alternatives,
+    // the grammar with the smallest frame kept. each
+    // run starts from the input expanded again from the grammar kept, so no
+    // copy of it is held, and logs and measures on its own: only the log
+    // lines, phases and rounds of the grammar kept are reported
+
+    const pz_shared_rules shared = pz_share(cfg);
+
+    config run = cfg;
+    std::ostringstream log;
+    pz_block_stats stats;
+
+    run.log = &log;
+
+    pz_induce(run, b, d, profile, bs != nullptr ? &stats : nullptr);
+
+    for(const auto& a : profile.alternatives) {
+
+        pz_profile alternative = profile;
+
+        alternative.multiplicity = a.first;
+        alternative.repeats = a.second;
+
+        block c = b;
+        dictionary e;
+        std::ostringstream clog;
+        pz_block_stats cstats;
+
+        pz_expand(c, d, shared);
+
+        run.log = &clog;
+
+        pz_induce(run, c, e, alternative, bs != nullptr ? &cstats : nullptr);
+
+        if(pz_frame_size(c, e) < pz_frame_size(b, d)) {
+            b.swap(c);
+            d = std::move(e);
+            log.swap(clog);
+            std::swap(stats, cstats);
+        }
+    }
+
+    *cfg.log << log.str();
+
+    if(bs != nullptr) {
+        for(const auto& phase : stats.phases)
+            bs->phases[phase.first] += phase.second;
+        bs->rounds.insert(bs->rounds.end(), stats.rounds.begin(), stats.rounds.end());
+    }
+}
+
+bool pz_compress_block(const config& cfg, block& b, uint32_t check, const pz_profile& profile, pz_writer& out, pz_block_stats *bs) {
+
+    // b is rewritten in place into the document. the input is only kept
+    // for the full expansion test of --verify, the frame checksum covers
+    // every other run
+
+    const size_t length = b.size();
+
+    block input;
+
+    if(cfg.verify)
+        input = b;
+
+    dictionary d;
+
+    *cfg.log << " : " << b.size() << " symbols" << std::endl;
+
+    if(profile.alternatives.empty())
+        pz_induce(cfg, b, d, profile, bs);
+    else
+        pz_induce_best(cfg, b, d, profile, bs);
+
+    //
+    // output
+    //
+
+    // the rules of the frame are written after those of the shared
+    // dictionary, which go back to their own symbols
+
+    const pz_shared_rules shared = pz_share(cfg);
+
+    auto written = [&shared](symbol x) -> uint16_t {
+        if(shared.contains(x))
+            return (uint16_t)symbol::first + (uint16_t)shared.index(x);
+        if(x >= symbol::first)
+            return (uint16_t)x + (uint16_t)shared.size();
+        return (uint16_t)x;
+    };
+
+    auto rule_comparison = [](const dictionary_rule& a, const dictionary_rule& b) {
+        return b.first > a.first;
+    };
+
+    const auto& max_rule = std::max_element(d.begin(), d.end(), rule_comparison);
+
+    if(max_rule != d.end() and max_rule->first + (int)shared.size() >= (symbol)pz_gap)
+        throw std::runtime_error("maximum symbol too big for now.");
+
+    if(bs != nullptr)
+        pz_rule_lengths(d, shared, bs);
+
+    pz_phase output(bs, "write");
+
+    pz_frame frame;
+
+    std::vector<uint8_t> arguments;
+
+    for(symbol s : b)
+        if(pz_is_argument(s))
+            arguments.push_back((uint8_t)pz_literal(s));
+
+    frame.length = length;
+    frame.symbols = b.size() - arguments.size();
+    frame.rules = d.size();
+    frame.flags = pz_frame_crc32c;
+    frame.check = check;
+    frame.arguments = arguments.size();
+    frame.size = pz_frame_size(b, d);
+
+    if(cfg.dictionary != nullptr) {
+        frame.flags |= pz_frame_shared;
+        frame.size += 2 * sizeof(uint16_t);
+    }
+
+    // at two bytes a symbol a grammar can come out larger than its input,
+    // which is then stored instead
+
+    if(frame.size >= length) {
+
+        pz_expand(b, d, shared);
+
+        if(bs != nullptr)
+            bs->mode = pz_mode_name[(int)pz_mode::store];
+
+        *cfg.log << " : stored, " << frame.size << " bytes compressed" << std::endl;
+
+        pz_store_block(b, check, out, bs);
+
+        return true;
+    }
+
+    out.put(frame);
+
+    if(frame.flags & pz_frame_shared)
+        out.put(cfg.dictionary->id);
+
+    for(const dictionary_rule& rule : d) {
+
+        out.put(written(rule.first));
+
+        for(auto iter = rule.second.begin(); iter != rule.second.end(); ) {
+
+            if(*iter != symbol::wildcard) {
+                out.put(written(*iter++));
+                continue;
+            }
+
+            uint16_t n = 0;
+
+            for(; iter != rule.second.end() and *iter == symbol::wildcard; iter++)
+                n++;
+
+            out.put(pz_gap);
+            out.put(n);
+        }
+
+        out.put((uint16_t)symbol::wildcard);
+    }
+
+    for(symbol s : b)
+        if(not pz_is_argument(s))
+            out.put(written(s));
+
+    out.write(arguments.data(), arguments.size());
+
+    output.stop();
+
+    if(bs != nullptr)
+        bs->output = sizeof(frame) + frame.size;
+
+    //
+    // test correctness
+    //
+
+    if(cfg.verify) {
+
+        pz_phase verify(bs, "verify");
+
+        pz_expand(b, d, shared);
+
+        if(b != input)
+            throw std::runtime_error("1st expansion test failed.");
+    }
+
+    return true;
+}
+
+uint64_t pz_frame_size(const block& b, const dictionary& d) {
+
+    // the payload of a frame for the grammar, less the id of a shared
+    // dictionary. a run of wildcards is written as two symbols, [pz_gap, n]
+
+    uint64_t symbols = 0;
+    uint64_t arguments = 0;
+
+    for(const dictionary_rule& rule : d) {
+
+        symbols += 2;
+
+        for(auto iter = rule.second.begin(); iter != rule.second.end(); iter++)
+            if(*iter != symbol::wildcard)
+                symbols++;
+            else if(*prev(iter) != symbol::wildcard)
+                symbols += 2;
+    }
+
+    for(symbol s : b) {
+        if(pz_is_argument(s))
+            arguments++;
+        else
+            symbols++;
+    }
+
+    return symbols * sizeof(uint16_t) + arguments;
+}
+
+bool pz_compress(const config& cfg, int fdin, int fdout, const char *name) {
+
+    // regular files are one frame unless a window is given, anything
+    // else is streamed in bounded windows flushed after cfg.latency
+
+    struct stat sb;
+
+    if(fstat(fdin, &sb) == -1) {
+        *cfg.log << strerror(errno) << std::endl;
+        return false;
+    }
+
+    size_t window = cfg.window;
+    int latency = 0;
+
+    if(not S_ISREG(sb.st_mode)) {
+        if(window == 0)
+            window = pz_stream_window;
+        latency = cfg.latency;
+    }
+
+    pz_writer out(fdout, cfg.direct);
+
+    out.write(pz_magic, sizeof(pz_magic));
+
+    bool eof = false;
+
+    pz_frame end;
+
+    end.flags = pz_frame_crc32c;
+
+    if(cfg.level == 0) {
+        if(not pz_store(cfg, fdin, sb, window, out, end, name))
+            return false;
+        eof = true;
+    } else if(cfg.memory > 0 and cfg.window == 0 and S_ISREG(sb.st_mode) and (uint64_t)sb.st_size > cfg.memory) {
+        if(not pz_compress_external(cfg, fdin, pz_profiles[cfg.level], out, end, name))
+            return false;
+        eof = true;
+    }
+
+    while(not eof) {
+
+        pz_block_stats stats;
+        pz_block_stats *bs = (cfg.stats != nullptr) ? &stats : nullptr;
+
+        pz_clock start;
+
+        if(bs != nullptr)
+            start = pz_clock::now();
+
+        pz_phase read(bs, "read");
+
+        uint32_t check;
+
+        meta<block> mb = pz_get_block(fdin, window, latency, eof, check);
+
+        read.stop();
+
+        if(!mb.first) {
+            *cfg.log << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if(mb.second.empty())
+            continue;
+
+        const size_t length = mb.second.size();
+
+        pz_phase probing(bs, "probe");
+
+        const pz_probe probe = pz_probe_block(mb.second);
+
+        probing.stop();
+
+        if(bs != nullptr)
+            bs->mode = pz_mode_name[(int)probe.mode];
+
+        if(probe.mode == pz_mode::store) {
+
+            *cfg.log << " : " << length << " symbols stored (entropy " << probe.entropy << ", repeats " << probe.repeats << ")" << std::endl;
+
+            pz_phase storing(bs, "store");
+
+            pz_store_block(mb.second, check, out, bs);
+
+        } else {
+
+            if(probe.mode == pz_mode::cheap)
+                *cfg.log << " : cheap induction (entropy " << probe.entropy << ", repeats " << probe.repeats << ")" << std::endl;
+
+            const pz_profile& profile = pz_profiles[probe.mode == pz_mode::cheap ? 1 : cfg.level];
+
+            pz_compress_block(cfg, mb.second, check, profile, out, bs);
+        }
+
+        // a streamed frame goes out as soon as it is done
+
+        if(latency > 0)
+            out.flush();
+
+        end.check = pz_crc32c_combine(end.check, check, length);
+
+        if(bs != nullptr) {
+            bs->input = length;
+            bs->time = pz_clock::now() - start;
+            cfg.stats->add(name, std::move(stats));
+        }
+    }
+
+    out.put(end);
+    out.flush();
+
+    return true;
+}
+
+//
+// regular files larger than cfg.memory are induced out of core, in frames
+// of digram rules of pz_external_frames of the budget each, so that the
+// decoder, which holds the document of a frame and its expansion, gets by
+// in about the budget as well. the symbols of a frame live in a temporary file, 16 bits
+// each, and a round is sequential passes over it: counting the pairs,
+// those of bytes in a flat table and the others in a bounded one, then
+// rewriting the symbols into a second file with the pairs seen
+// multiplicity times replaced left to right. pairs that do not fit in the
+// table are split by hash into parts, each counted exactly in a pass of
+// its own. rules left unused are dropped when the frame is written.
+//
+// the budget is at least pz_external_minimum. pz_external_fixed of it goes
+// to what does not depend on it: the byte pair counts, the rules and their
+// candidates, remapping and the output buffer. half of the rest is the
+// pair table and half the buffers of a pass.
+//
+
+constexpr size_t pz_external_minimum = 8 << 20;
+constexpr size_t pz_external_fixed = 5 << 20;
+constexpr size_t pz_external_frames = 4;
+
+struct pz_pair_table {
+
+    // exact counts of up to half as many pairs as slots
+
+    std::vector<uint64_t> keys; // key + 1, 0 if empty
+    std::vector<uint64_t> counts;
+    size_t used = 0;
+
+    pz_pair_table(size_t slots) : keys(slots, 0), counts(slots, 0) {
+    }
+
+    static uint64_t hash(uint64_t key) {
+        return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+    }
+
+    bool add(uint64_t key) {
+
+        size_t n = hash(key);
+
+        while(keys[n & (keys.size() - 1)] != 0 and keys[n & (keys.size() - 1)] != key + 1)
+            n++;
+
+        n &= keys.size() - 1;
+
+        if(keys[n] == 0) {
+            if(2 * (used + 1) > keys.size())
+                return false;
+            keys[n] = key + 1;
+            used++;
+        }
+
+        counts[n]++;
+
+        return true;
+    }
+
+    void clear() {
+        std::fill(keys.begin(), keys.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+        used = 0;
+    }
+};
+
+bool pz_compress_external(const config& cfg, int fdin, const pz_profile& profile, pz_writer& out, pz_frame& end, const char *name) {
+
+    const uint64_t limit = std::max(cfg.memory, pz_external_minimum) / pz_external_frames;
+
+    for(bool eof = false; not eof; )
+        if(not pz_compress_external_frame(cfg, fdin, profile, limit, out, end, name, eof))
+            return false;
+
+    return true;
+}
+
+bool pz_compress_external_frame(const config& cfg, int fdin, const pz_profile& profile, uint64_t limit, pz_writer& out, pz_frame& end, const char *name, bool& eof) {
+
+    // induces the next limit bytes of fdin, eof set once they run short
+
+    pz_block_stats stats;
+    pz_block_stats *bs = (cfg.stats != nullptr) ? &stats : nullptr;
+
+    pz_clock begin;
+    pz_clock start;
+
+    if(bs != nullptr) {
+        begin = pz_clock::now();
+        bs->mode = "external";
+    }
+
+    const size_t rest = std::max(cfg.memory, pz_external_minimum) - pz_external_fixed;
+
+    // a chunk of symbols is read, written out and, at first, read as bytes
+
+    const size_t chunk = rest / 2 / (2 * sizeof(uint16_t) + 1);
+
+    size_t slots = 1 << 10;
+
+    while(2 * slots * 2 * sizeof(uint64_t) <= rest / 2)
+        slots <<= 1;
+
+    std::vector<uint16_t> symbols(chunk);
+
+    pz_fd a(pz_tmpfile());
+    pz_fd b(pz_tmpfile());
+
+    const off_t offset = lseek(fdin, 0, SEEK_CUR);
+
+    uint64_t length = 0;
+    uint64_t size = 0;
+    uint32_t check = 0;
+
+    {
+        pz_phase read(bs, "read");
+
+        pz_writer w(a, false, chunk * sizeof(uint16_t));
+
+        std::vector<uint8_t> bytes(chunk);
+
+        ssize_t n = 0;
+
+        while(length < limit and (n = pz_read(fdin, bytes.data(), std::min<uint64_t>(bytes.size(), limit - length))) > 0) {
+
+            check = pz_crc32c(check, bytes.data(), n);
+
+            for(ssize_t k = 0; k < n; k++)
+                symbols[k] = bytes[k];
+
+            w.write(symbols.data(), n * sizeof(uint16_t));
+
+            length += n;
+        }
+
+        if(n == -1) {
+            *cfg.log << strerror(errno) << std::endl;
+            return false;
+        }
+
+        w.flush();
+    }
+
+    eof = length < limit;
+
+    if(length == 0)
+        return true;
+
+    size = length;
+
+    *cfg.log << " : " << length << " symbols out of core" << std::endl;
+
+    // each pass reads a from the start, chunk symbols at a time
+
+    auto pass = [&](std::function<void(const uint16_t *, size_t)> f) {
+
+        lseek(a, 0, SEEK_SET);
+
+        for(;;) {
+
+            ssize_t n = pz_read(a, symbols.data(), symbols.size() * sizeof(uint16_t));
+
+            if(n == -1)
+                throw std::runtime_error(std::string("out of core pass: ") + strerror(errno));
+
+            if(n == 0)
+                break;
+
+            f(symbols.data(), n / sizeof(uint16_t));
+        }
+    };
+
+    std::vector<std::pair<uint16_t,uint16_t>> rules;
+
+    pz_pair_table others(slots);
+
+    size_t parts = 1;
+
+    pz_phase induce(bs, "induce");
+
+    for(size_t round = 0; profile.rounds == 0 or round < profile.rounds; round++) {
+
+        pz_round_stats rs;
+
+        rs.round = round;
+
+        if(bs != nullptr)
+            start = pz_clock::now();
+
+        const size_t room = (size_t)pz_gap - (size_t)symbol::first - rules.size();
+
+        if(room == 0)
+            break;
+
+        // the pairs worth a rule, at most room of the most frequent, kept
+        // in a heap with the least frequent on top
+
+        using candidate = std::pair<uint64_t,uint32_t>;
+
+        std::vector<candidate> candidates;
+
+        auto consider = [&](uint32_t key, uint64_t count) {
+            rs.histogram++;
+            if(count >= profile.multiplicity and pz_gain(measurement({ (symbol)0, (symbol)0 }, count)) > 0) {
+                candidates.emplace_back(count, key);
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<candidate>());
+                if(candidates.size() > room) {
+                    std::pop_heap(candidates.begin(), candidates.end(), std::greater<candidate>());
+                    candidates.pop_back();
+                }
+            }
+        };
+
+        for(size_t part = 0; part < parts;) {
+
+            std::vector<uint64_t> bytes(part == 0 ? 1 << 16 : 0, 0);
+
+            bool full = false;
+            int32_t last = -1;
+
+            others.clear();
+
+            pass([&](const uint16_t *s, size_t n) {
+                for(size_t k = 0; k < n; k++) {
+                    if(last != -1) {
+                        const uint64_t key = (uint64_t)last << 16 | s[k];
+                        if(last < 256 and s[k] < 256) {
+                            if(part == 0)
+                                bytes[last << 8 | s[k]]++;
+                        } else if(pz_pair_table::hash(key) % parts == part and not full) {
+                            full = not others.add(key);
+                        }
+                    }
+                    last = s[k];
+                }
+            });
+
+            // start over in twice as many parts
+
+            if(full) {
+                parts *= 2;
+                part = 0;
+                rs.histogram = 0;
+                candidates.clear();
+                continue;
+            }
+
+            for(uint32_t k = 0; k < bytes.size(); k++)
+                if(bytes[k] != 0)
+                    consider((k >> 8) << 16 | (k & 0xff), bytes[k]);
+
+            for(size_t n = 0; n < others.keys.size(); n++)
+                if(others.keys[n] != 0)
+                    consider(others.keys[n] - 1, others.counts[n]);
+
+            part++;
+        }
+
+        std::sort(candidates.begin(), candidates.end(), std::greater<candidate>());
+
+        rs.candidates = candidates.size();
+
+        if(candidates.empty())
+            break;
+
+        // the chosen pairs by key, each with its rule, and which symbols
+        // start one so that most pairs are not looked up at all
+
+        std::vector<std::pair<uint32_t,uint16_t>> chosen;
+        std::vector<bool> starts(1 << 16, false);
+
+        for(const auto& x : candidates) {
+            chosen.emplace_back(x.second, (uint16_t)symbol::first + rules.size());
+            starts[x.second >> 16] = true;
+            rules.emplace_back(x.second >> 16, x.second & 0xffff);
+        }
+
+        std::sort(chosen.begin(), chosen.end());
+
+        rs.created = candidates.size();
+
+        candidates = std::vector<candidate>();
+
+        // rewrite a into b, then swap them
+
+        {
+            pz_writer w(b, false, chunk * sizeof(uint16_t));
+
+            int32_t last = -1;
+
+            size = 0;
+
+            auto emit = [&](uint16_t x) {
+                w.put(x);
+                size++;
+            };
+
+            pass([&](const uint16_t *s, size_t n) {
+                for(size_t k = 0; k < n; k++) {
+
+                    if(last != -1) {
+
+                        const uint32_t key = (uint32_t)last << 16 | s[k];
+
+                        auto iter = chosen.end();
+
+                        if(starts[last])
+                            iter = std::lower_bound(chosen.begin(), chosen.end(), std::make_pair(key, (uint16_t)0));
+
+                        if(iter != chosen.end() and iter->first == key) {
+                            emit(iter->second);
+                            rs.replacements++;
+                            last = -1;
+                            continue;
+                        }
+
+                        emit(last);
+                    }
+
+                    last = s[k];
+                }
+            });
+
+            if(last != -1)
+                emit(last);
+
+            w.flush();
+        }
+
+        a.swap(b);
+
+        if(ftruncate(b, 0) == -1 or lseek(b, 0, SEEK_SET) == -1)
+            throw std::runtime_error(std::string("out of core rewrite: ") + strerror(errno));
+
+        *cfg.log << "document: " << size << " symbols ~ dictionary: " << rules.size() << " rules ";
+        *cfg.log << 3 * rules.size() << " symbols = " << (size + 3 * rules.size()) << " total symbols" << std::endl;
+
+        if(bs != nullptr) {
+            rs.time = pz_clock::now() - start;
+            rs.symbols = size;
+            rs.rules = rules.size();
+            bs->rounds.push_back(rs);
+        }
+
+        if(rs.replacements == 0)
+            break;
+    }
+
+    induce.stop();
+
+    // drop the rules nothing uses, the later ones first as they only
+    // use earlier ones, and number the others densely in the same order
+
+    std::vector<uint64_t> uses(rules.size(), 0);
+
+    pass([&](const uint16_t *s, size_t n) {
+        for(size_t k = 0; k < n; k++)
+            if(s[k] >= (uint16_t)symbol::first)
+                uses[s[k] - (uint16_t)symbol::first]++;
+    });
+
+    for(size_t n = rules.size(); n-- > 0; ) {
+        if(uses[n] == 0)
+            continue;
+        for(uint16_t x : { rules[n].first, rules[n].second })
+            if(x >= (uint16_t)symbol::first)
+                uses[x - (uint16_t)symbol::first]++;
+    }
+
+    std::vector<uint16_t> remap(1 << 16);
+
+    std::iota(remap.begin(), remap.begin() + (int)symbol::first, 0);
+
+    uint16_t next = (uint16_t)symbol::first;
+
+    for(size_t n = 0; n < rules.size(); n++)
+        if(uses[n] != 0)
+            remap[(uint16_t)symbol::first + n] = next++;
+
+    pz_phase output(bs, "write");
+
+    pz_frame frame;
+
+    frame.length = length;
+    frame.symbols = size;
+    frame.rules = next - (uint16_t)symbol::first;
+    frame.flags = pz_frame_crc32c;
+    frame.check = check;
+    frame.size = (4 * (uint64_t)frame.rules + frame.symbols) * sizeof(uint16_t);
+
+    if(frame.size >= length) {
+
+        *cfg.log << " : stored, " << frame.size << " bytes compressed" << std::endl;
+
+        frame.size = frame.length;
+        frame.symbols = 0;
+        frame.rules = 0;
+        frame.flags = pz_frame_crc32c | pz_frame_stored;
+
+        out.put(frame);
+        out.copy(fdin, offset, frame.length);
+
+    } else {
+
+        out.put(frame);
+
+        for(size_t n = 0; n < rules.size(); n++) {
+            if(uses[n] != 0) {
+                out.put(remap[(uint16_t)symbol::first + n]);
+                out.put(remap[rules[n].first]);
+                out.put(remap[rules[n].second]);
+                out.put((uint16_t)symbol::wildcard);
+            }
+        }
+
+        pass([&](const uint16_t *s, size_t n) {
+            for(size_t k = 0; k < n; k++)
+                out.put(remap[s[k]]);
+        });
+    }
+
+    output.stop();
+
+    end.check = pz_crc32c_combine(end.check, check, length);
+
+    if(bs != nullptr) {
+        bs->input = length;
+        bs->output = sizeof(frame) + frame.size;
+        bs->time = pz_clock::now() - begin;
+        cfg.stats->add(name, std::move(stats));
+    }
+
+    return true;
+}
+
+bool pz_store(const config& cfg, int fdin, const struct stat& sb, size_t window, pz_writer& out, pz_frame& end, const char *name) {
+
+    // level 0 wraps the input in stored frames. a regular file is checksummed
+    // through a read only mapping of the page cache and copied by the kernel,
+    // anything else is read and written a frame per read()
+
+    auto store = [&](pz_frame& frame, const void *p, off_t offset) {
+
+        pz_block_stats stats;
+        pz_phase phase(&stats, "store");
+
+        frame.size = frame.length;
+        frame.flags = pz_frame_crc32c | pz_frame_stored;
+
+        out.put(frame);
+
+        if(p == nullptr)
+            out.copy(fdin, offset, frame.length);
+        else
+            out.write(p, frame.length);
+
+        phase.stop();
+
+        end.check = pz_crc32c_combine(end.check, frame.check, frame.length);
+
+        if(cfg.stats != nullptr) {
+            stats.input = frame.length;
+            stats.output = sizeof(frame) + frame.size;
+            stats.time = stats.phases["store"];
+            cfg.stats->add(name, std::move(stats));
+        }
+    };
+
+    off_t offset = lseek(fdin, 0, SEEK_CUR);
+
+    if(S_ISREG(sb.st_mode) and sb.st_size > 0 and offset != -1) {
+
+        const off_t page = sysconf(_SC_PAGESIZE);
+
+        const size_t step = (window == 0) ? sb.st_size : window;
+
+        while(offset < sb.st_size) {
+
+            pz_frame frame;
+
+            frame.length = std::min<uint64_t>(step, sb.st_size - offset);
+
+            const off_t base = offset - offset % page;
+            const size_t sz = frame.length + (offset - base);
+
+            void *p = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fdin, base);
+
+            if(p == MAP_FAILED) {
+                *cfg.log << strerror(errno) << std::endl;
+                return false;
+            }
+
+            madvise(p, sz, MADV_SEQUENTIAL);
+
+            frame.check = pz_crc32c(0, (char *)p + (offset - base), frame.length);
+
+            munmap(p, sz);
+
+            store(frame, nullptr, offset);
+
+            offset += frame.length;
+        }
+
+        lseek(fdin, offset, SEEK_SET);
+
+        return true;
+    }
+
+    std::vector<uint8_t> bytes(window == 0 ? pz_stream_window : window);
+
+    for(;;) {
+
+        ssize_t n = read(fdin, bytes.data(), bytes.size());
+
+        if(n == -1) {
+            if(errno == EINTR or errno == EAGAIN)
+                continue;
+            *cfg.log << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if(n == 0)
+            break;
+
+        pz_frame frame;
+
+        frame.length = n;
+        frame.check = pz_crc32c(0, bytes.data(), n);
+
+        store(frame, bytes.data(), 0);
+
+        out.flush();
+    }
+
+    return true;
+}
+
+bool pz_decompress(const config& cfg, int fdin, int fdout, const char *name) {
+
+    uint8_t magic[sizeof(pz_magic)];
+
+    if(pz_read(fdin, magic, sizeof(magic)) != sizeof(magic) or memcmp(magic, pz_magic, sizeof(magic)) != 0)
+        throw std::runtime_error("not in " + std::string(pz_extension) + " format");
+
+    uint32_t stream = 0;
+
+    struct stat sb;
+
+    const bool streaming = fstat(fdin, &sb) == 0 and not S_ISREG(sb.st_mode);
+
+    pz_writer out(fdout, cfg.direct);
+
+    for(;;) {
+
+        pz_block_stats stats;
+        pz_block_stats *bs = (cfg.stats != nullptr) ? &stats : nullptr;
+
+        pz_clock start;
+
+        if(bs != nullptr)
+            start = pz_clock::now();
+
+        auto record = [&](const pz_frame& frame, const char *mode) {
+            if(bs != nullptr) {
+                bs->mode = mode;
+                bs->input = sizeof(frame) + frame.size;
+                bs->output = frame.length;
+                bs->time = pz_clock::now() - start;
+                cfg.stats->add(name, std::move(stats));
+            }
+        };
+
+        pz_phase read(bs, "read");
+
+        pz_frame frame;
+
+        if(pz_read(fdin, &frame, sizeof(frame)) != sizeof(frame))
+            throw std::runtime_error("unexpected end of stream");
+
+        // the end frame is either the last thing in the input or followed
+        // by another stream, as pzip -c writes for several files
+
+        if(frame.length == 0) {
+
+            if((frame.flags & pz_frame_crc32c) and frame.check != stream)
+                throw std::runtime_error("stream checksum mismatch");
+
+            const ssize_t n = pz_read(fdin, magic, sizeof(magic));
+
+            if(n == 0)
+                break;
+
+            if(n != sizeof(magic) or memcmp(magic, pz_magic, sizeof(magic)) != 0)
+                throw std::runtime_error("trailing garbage after stream");
+
+            stream = 0;
+
+            continue;
+        }
+
+        if(frame.flags & pz_frame_stored) {
+
+            if(frame.size != frame.length)
+                throw std::runtime_error("corrupt frame header");
+
+            read.stop();
+
+            pz_phase storing(bs, "store");
+
+            std::vector<uint8_t> bytes(std::min<uint64_t>(frame.size, pz_stream_window));
+
+            uint32_t check = 0;
+
+            for(uint64_t left = frame.size; left > 0; ) {
+
+                size_t n = std::min<uint64_t>(left, bytes.size());
+
+                if(pz_read(fdin, bytes.data(), n) != (ssize_t)n)
+                    throw std::runtime_error("unexpected end of frame");
+
+                check = pz_crc32c(check, bytes.data(), n);
+                out.write(bytes.data(), n);
+
+                left -= n;
+            }
+
+            if((frame.flags & pz_frame_crc32c) and check != frame.check)
+                throw std::runtime_error("frame checksum mismatch");
+
+            stream = pz_crc32c_combine(stream, check, frame.length);
+
+            if(streaming)
+                out.flush();
+
+            storing.stop();
+
+            record(frame, "store");
+
+            continue;
+        }
+
+        if(frame.size < frame.arguments or (frame.size - frame.arguments) % sizeof(uint16_t) != 0)
+            throw std::runtime_error("corrupt frame header");
+
+        std::vector<uint16_t> payload;
+        std::vector<uint8_t> arguments;
+
+        if(not pz_read_vector(fdin, payload, (frame.size - frame.arguments) / sizeof(uint16_t)))
+            throw std::runtime_error("unexpected end of frame");
+
+        if(not pz_read_vector(fdin, arguments, frame.arguments))
+            throw std::runtime_error("unexpected end of frame");
+
+        read.stop();
+
+        pz_phase parse(bs, "parse");
+
+        // the rules of the frame follow those of the shared dictionary.
+        // they are read into d from symbol::first on and the shared rules
+        // are renumbered after them, see pz_shared_rules
+
+        dictionary d;
+
+        pz_shared_rules shared;
+        int own = (int)symbol::first;
+
+        auto pos = payload.begin();
+
+        if(frame.flags & pz_frame_shared) {
+
+            if(payload.size() < 2)
+                throw std::runtime_error("corrupt frame header");
+
+            const uint32_t id = payload[0] | (uint32_t)payload[1] << 16;
+
+            pos += 2;
+
+            if(cfg.dictionary == nullptr or cfg.dictionary->id != id) {
+                std::stringstream ss;
+                ss << "needs dictionary " << std::hex << std::setw(8) << std::setfill('0') << id << " (-D)";
+                throw std::runtime_error(ss.str());
+            }
+
+            shared.mapped = cfg.dictionary;
+            own += (int)cfg.dictionary->size();
+        }
+
+        shared.first = symbol::first + (int)std::min<uint32_t>(frame.rules, pz_gap);
+
+        auto local = [&](uint16_t x) -> symbol {
+            if(x < (int)symbol::first)
+                return (symbol)x;
+            if(x < own)
+                return shared.first + (x - (int)symbol::first);
+            if((uint32_t)(x - own) >= frame.rules)
+                throw std::runtime_error("corrupt dictionary");
+            return symbol::first + (x - own);
+        };
+
+        for(uint32_t n = 0; n < frame.rules; n++) {
+
+            if(pos == payload.end() or *pos < own or *pos >= pz_gap or d.contains(local(*pos)))
+                throw std::runtime_error("corrupt dictionary");
+
+            block& rule = d[local(*pos++)];
+
+            while(pos != payload.end() and *pos != (uint16_t)symbol::wildcard) {
+
+                if(*pos != pz_gap) {
+                    rule.push_back(local(*pos++));
+                    continue;
+                }
+
+                if(++pos == payload.end() or *pos == 0)
+                    throw std::runtime_error("corrupt dictionary");
+
+                rule.insert(rule.end(), *pos++, symbol::wildcard);
+            }
+
+            if(pos == payload.end())
+                throw std::runtime_error("corrupt dictionary");
+
+            pos++;
+        }
+
+        if((uint64_t)(payload.end() - pos) != frame.symbols)
+            throw std::runtime_error("corrupt document");
+
+        // each gapped rule takes back its arguments, which only the
+        // document may hold
+
+        auto arity = [&d](symbol x) -> size_t {
+            const auto rule = d.find(x);
+            return rule == d.end() ? 0 : std::count(rule->second.begin(), rule->second.end(), symbol::wildcard);
+        };
+
+        for(const auto& rule : d)
+            for(symbol x : rule.second)
+                if(x >= symbol::first and arity(x) != 0)
+                    throw std::runtime_error("corrupt dictionary");
+
+        std::vector<symbol> doc;
+
+        doc.reserve(frame.symbols + frame.arguments);
+
+        auto argument = arguments.begin();
+
+        while(pos != payload.end()) {
+
+            const symbol x = local(*pos++);
+
+            doc.push_back(x);
+
+            for(size_t n = arity(x); n > 0; n--) {
+                if(argument == arguments.end())
+                    throw std::runtime_error("corrupt document");
+                doc.push_back(pz_argument((symbol)*argument++));
+            }
+        }
+
+        if(argument != arguments.end())
+            throw std::runtime_error("corrupt document");
+
+        // the document holds all of the payload from here on
+
+        payload = std::vector<uint16_t>();
+        arguments = std::vector<uint8_t>();
+
+        parse.stop();
+
+        pz_phase expand(bs, "expand");
+
+        std::vector<uint8_t> bytes;
+
+        const uint32_t check = pz_expand_parallel(doc, d, shared, frame.length, bytes);
+
+        expand.stop();
+
+        if((frame.flags & pz_frame_crc32c) and check != frame.check)
+            throw std::runtime_error("frame checksum mismatch");
+
+        stream = pz_crc32c_combine(stream, check, frame.length);
+
+        pz_phase output(bs, "write");
+
+        out.write(bytes.data(), frame.length);
+
+        if(streaming)
+            out.flush();
+
+        output.stop();
+
+        record(frame, "full");
+    }
+
+    out.flush();
+
+    return true;
+}
+
+bool pz_train(const config& cfg) {
+
+    // the files are read into one block and induced together, with no
+    // gapped rules as the arguments of a shared rule would be left out of
+    // its expansion. pz_remap leaves each body naming lower rules only, as
+    // a dictionary needs them
+
+    block b;
+
+    auto read = [&](int fd, const char *name) -> bool {
+
+        bool eof;
+        uint32_t check;
+
+        meta<block> mb = pz_get_block(fd, 0, 0, eof, check);
+
+        if(not mb.first) {
+            *cfg.log << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        b.splice(b.end(), mb.second);
+
+        return true;
+    };
+
+    if(cfg.files.empty() and not read(STDIN_FILENO, "-"))
+        return false;
+
+    for(const auto& file : cfg.files) {
+
+        int fd = open(file.c_str(), O_RDONLY);
+
+        if(fd == -1) {
+            *cfg.log << file << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        bool ok = read(fd, file.c_str());
+
+        close(fd);
+
+        if(not ok)
+            return false;
+    }
+
+    config training = cfg;
+
+    training.dictionary = nullptr;
+
+    pz_profile profile = pz_profiles[std::max<size_t>(cfg.level, 1)];
+
+    profile.gapped = false;
+
+    *cfg.log << std::setw(12) << cfg.train << ": " << b.size() << " symbols" << std::endl;
+
+    dictionary d;
+
+    try {
+
+        pz_induce(training, b, d, profile, nullptr);
+
+        if(d.size() >= (size_t)pz_gap - (size_t)symbol::first)
+            throw std::runtime_error("too many rules for a dictionary");
+
+        std::vector<std::vector<uint16_t>> rules;
+
+        for(const auto& rule : d) {
+            rules.emplace_back();
+            for(symbol x : rule.second)
+                rules.back().push_back((uint16_t)x);
+        }
+
+        pz_dictionary shared;
+
+        shared.build(rules);
+        shared.save(cfg.train);
+
+        *cfg.log << std::setw(12) << cfg.train << ": " << shared.size() << " rules, id ";
+        *cfg.log << std::hex << std::setw(8) << std::setfill('0') << shared.id << std::dec << std::setfill(' ') << std::endl;
+
+    } catch(const std::exception& e) {
+
+        *cfg.log << e.what() << std::endl;
+
+        return false;
+    }
+
+    return true;
+}
+
+bool pz_process_fd(const config& cfg, int fdin, int fdout, const char *name) {
+
+    try {
+
+        return cfg.compress ? pz_compress(cfg, fdin, fdout, name) : pz_decompress(cfg, fdin, fdout, name);
+
+    } catch(const std::exception& e) {
+
+        *cfg.log << e.what() << std::endl;
+    }
+
+    return false;
+}
+
+bool pz_process_file(const config& cfg, const char *filenamein) {
+
+    int fdin;
+    int fdout;
+    struct stat sb;
+
+    std::string filenameout;
+
+    *cfg.log << std::setw(12) << filenamein << ": ";
+
+    if(lstat(filenamein, &sb) == -1) {
+        *cfg.log << strerror(errno) << std::endl;
+        return false;
+    }
+
+    if(S_ISDIR(sb.st_mode)) {
+        *cfg.log << "ignoring directory" << std::endl;
+        return false;
+    }
+
+    if(cfg.stdoutput) {
+
+        // if output is standard output then
+        // input type doesnt matter
+        // as long as it can be read
+
+        fdout = cfg.output;
+
+    } else {
+
+        // if output is not standard output
+        // then only compress regular files
+
+        if(not S_ISREG(sb.st_mode)) {
+            *cfg.log << "ignoring " << get_file_type(sb) << std::endl;
+            return false;
+        }
 
         // if output is not standard output
         // then make sure the filenamein suffix
@@ -556,54 +3037,115 @@ bool pz_process_file(const config& cfg, const char *filenamein) {
 
         const char *p = filenamein + filenamein_sz;
 
-        std::string filenameout(filenamein);
+        filenameout = filenamein;
 
         if(extension_sz < filenamein_sz)
             p -= extension_sz;
 
         if(strcmp(p, pz_extension) == 0) {
             if(cfg.compress) {
-                std::cerr << "already has " << pz_extension << " suffix -- ignored" << std::endl;
+                *cfg.log << "already has " << pz_extension << " suffix -- ignored" << std::endl;
                 return false;
             }
             filenameout.erase(filenameout.end() - extension_sz, filenameout.end());
         } else {
             if(not cfg.compress) {
-                std::cerr << "unknown suffix -- ignored" << std::endl;
+                *cfg.log << "unknown suffix -- ignored" << std::endl;
                 return false;
 
             }
             filenameout += pz_extension;
         }
 
-        std::cerr << "=> " << filenameout;
+        *cfg.log << "=> " << filenameout << std::endl;
 
         fdout = open(filenameout.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0664);
         if(fdout == -1) {
-            std::cerr << strerror(errno) << std::endl;
+            *cfg.log << strerror(errno) << std::endl;
             return false;
         }
     }
 
     fdin = open(filenamein, O_RDONLY);
     if(fdin == -1) {
-        std::cerr << strerror(errno) << std::endl;
-        if(fdout != STDOUT_FILENO)
+        *cfg.log << strerror(errno) << std::endl;
+        if(fdout != cfg.output)
             close(fdout);
         return false;
     }
 
-    pz_process_fd(cfg, fdin, fdout);
-
-    std::cerr << std::endl;
+    const bool ok = pz_process_fd(cfg, fdin, fdout, filenamein);
 
     close(fdin);
-    if(fdout != STDOUT_FILENO)
+    if(fdout != cfg.output)
         close(fdout);
 
-    return true;
+    // a failed output is not left behind, truncated or empty
+
+    if(not ok and not filenameout.empty())
+        unlink(filenameout.c_str());
+
+    return ok;
+}
+
+#ifdef PZ_FUZZ
+
+//
+// libfuzzer entry point, built by make fuzz. the first byte picks the level
+// and whether the rest is compressed and must decompress back to itself or
+// is decompressed as it is, which may fail but must not crash or hang
+//
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+    if(size == 0)
+        return 0;
+
+    std::ostream null(nullptr);
+
+    config cfg;
+
+    cfg.log = &null;
+    cfg.level = data[0] % 10;
+    cfg.window = (data[0] & 0x40) ? 256 : 0;
+
+    int in = pz_memfd("in", data + 1, size - 1);
+    int out = pz_memfd("out", nullptr, 0);
+
+    if(data[0] & 0x80) {
+
+        cfg.compress = false;
+        pz_process_fd(cfg, in, out, "fuzz");
+
+    } else {
+
+        int back = pz_memfd("back", nullptr, 0);
+
+        if(not pz_process_fd(cfg, in, out, "fuzz"))
+            abort();
+
+        cfg.compress = false;
+        lseek(out, 0, SEEK_SET);
+
+        if(not pz_process_fd(cfg, out, back, "fuzz"))
+            abort();
+
+        lseek(back, 0, SEEK_SET);
+
+        if(pz_slurp(back) != std::string((const char *)data + 1, size - 1))
+            abort();
+
+        close(back);
+    }
+
+    close(in);
+    close(out);
+
+    return 0;
 }
 
+#else
+
 int main(int argc, char **argv) {
 
     config cfg;
@@ -618,15 +3160,54 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if(not cfg.train.empty())
+        return pz_train(cfg) ? 0 : 1;
+
+    pz_dictionary shared;
+
+    if(not cfg.dictfile.empty()) {
+
+        try {
+            shared.load(cfg.dictfile);
+        } catch(const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+
+        cfg.dictionary = &shared;
+    }
+
+    std::unique_ptr<pz_stats> stats;
+
+    if(not cfg.statsfile.empty()) {
+        stats.reset(new pz_stats("pzip"));
+        cfg.stats = stats.get();
+        pz_heap::track(true);
+    }
+
+    bool ok = true;
+
     if(cfg.files.empty()) {
 
-        pz_process_fd(cfg, STDIN_FILENO, STDOUT_FILENO);
+        ok = pz_process_fd(cfg, STDIN_FILENO, STDOUT_FILENO, "-");
+
+    } else if(cfg.jobs > 1) {
+
+        ok = run_jobs(cfg, pz_process_file);
 
     } else {
 
         for(auto file : cfg.files)
-            pz_process_file(cfg, file.c_str());
+            ok = pz_process_file(cfg, file.c_str()) and ok;
     }
 
-    return 0;
+    if(stats)
+        stats->peak_heap = pz_heap::peak();
+
+    if(stats and not stats->write(cfg.statsfile))
+        std::cerr << cfg.statsfile << ": " << strerror(errno) << std::endl;
+
+    return ok ? 0 : 1;
 }
+
+#endif
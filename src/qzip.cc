@@ -36,6 +36,7 @@ extern "C" {
 
 #include <config.hh>
 #include <arithmetic.hh>
+#include <libpz.hh>
 
 arithmetic(symbol,uint16_t);
 using runlength = uint16_t;
@@ -493,7 +494,7 @@ std::set<block> qz_get_ngrams(const block& b) {
     return ngrams;
 }
 
-bool qz_process_fd(const config&, int fdin, int fdout) {
+bool qz_process_fd(const config& cfg, int fdin, int fdout) {
 
     auto print_info = [](const block& bl, const dictionary& di) {
 
@@ -580,29 +581,22 @@ bool qz_process_fd(const config&, int fdin, int fdout) {
     if(max_rule->first >= symbol::max_16bit)
         throw std::runtime_error("maximum symbol too big for now.");
 
-    for(const dictionary_rule& rule : d) {
+    pz_writer out(fdout, cfg.direct);
 
-        uint16_t x = (uint16_t)rule.first;
-        int16_t y = (int16_t)symbol::wildcard;
+    for(const dictionary_rule& rule : d) {
 
-        if(write(fdout, &x, sizeof(x)) != sizeof(x))
-            throw std::runtime_error("write(rule.first) failed");
+        out.put((uint16_t)rule.first);
 
-        for(symbol s : rule.second) {
-            x = (uint16_t)s;
-            if(write(fdout, &x, sizeof(x)) != sizeof(x))
-                throw std::runtime_error("write(rule.second) failed");
-        }
+        for(symbol s : rule.second)
+            out.put((uint16_t)s);
 
-        if(write(fdout, &y, sizeof(y)) != sizeof(y))
-            throw std::runtime_error("write(symbol::wildcard) failed");
+        out.put((uint16_t)symbol::wildcard);
     }
 
-    for(symbol s : b) {
-        uint16_t x = (uint16_t)s;
-        if(write(fdout, &x, sizeof(x)) != sizeof(x))
-            throw std::runtime_error("write(block) failed");
-    }
+    for(symbol s : b)
+        out.put((uint16_t)s);
+
+    out.flush();
 
     //
     // test correctness
@@ -714,6 +708,8 @@ int main(int argc, char **argv) {
 
     config cfg;
 
+    cfg.takes = 0;
+
     if(not cfg.getopt(argc, argv)) {
         std::cerr << "Try `" << *argv << " -h' for more information." << std::endl;
         return -1;
@@ -26,6 +26,8 @@
 #include <map>
 #include <algorithm>
 #include <set>
+#include <unordered_map>
+#include <memory>
 
 extern "C" {
 #include <unistd.h>
@@ -35,16 +37,23 @@ extern "C" {
 }
 
 #include <config.hh>
+#include <table.hh>
+#include <jobs.hh>
+#include <heap.hh>
+#include <libpz.hh>
 
 struct term;
 struct dictionary;
 
 using symbol = int32_t;
 using expression = std::list<term>;
-using rdictionary = std::map<expression, symbol>;
 
 using term_baseclass = std::pair<size_t, symbol>;
-using dictionary_baseclass = std::map<symbol, expression>;
+using dictionary_baseclass = rule_table<symbol, expression, -256, -1>;
+
+using digram = std::pair<term_baseclass, term_baseclass>;
+using rdictionary = std::unordered_map<digram, symbol, pair_hash>;
+using census = rule_census<dictionary_baseclass>;
 
 using rule = dictionary_baseclass::value_type;
 
@@ -56,6 +65,7 @@ struct term : term_baseclass {
 struct dictionary : dictionary_baseclass {
 	using dictionary_baseclass::dictionary_baseclass;
 	expression& expand(expression&) const;
+	size_t expansion_length(symbol) const;
 	key_type next_key() const;
 };
 
@@ -63,7 +73,7 @@ term::term(const symbol& x) : term(1,x) {
 }
 
 dictionary::key_type dictionary::next_key() const {
-	return -(size() + 256);
+	return key(extent());
 }
 
 expression& dictionary::expand(expression& expr) const {
@@ -88,14 +98,32 @@ expression& dictionary::expand(expression& expr) const {
 	return expr;
 }
 
+size_t dictionary::expansion_length(symbol x) const {
+
+	auto rule = find(x);
+
+	if(rule == end())
+		return 1;
+
+	size_t n = 0;
+
+	for(const auto& y : rule->second)
+		n += y.first * expansion_length(y.second);
+
+	return n;
+}
+
 const char *rz_extension = ".rz";
 
 bool rz_process_file(const config&, const char *);
-bool rz_process_fd(const config&, int, int);
+bool rz_process_fd(const config&, int, int, const char *);
 
-bool rz_compress_block(const config&, void *, size_t, int);
+bool rz_compress_block(const config&, void *, size_t, pz_writer&, pz_block_stats *);
 
-bool rz_compress(const config&, int, int);
+void rz_forget_rule(rdictionary&, const dictionary&, symbol);
+void rz_inline_rule(dictionary&, rdictionary&, census&, symbol);
+
+bool rz_compress(const config&, int, int, const char *);
 bool rz_decompress(const config&, int, int);
 
 constexpr char ansi_save_pos[] = "\033[s";
@@ -144,116 +172,305 @@ ssize_t read_block(int fd, void *block, size_t block_sz) {
 	return done;
 }
 
-bool rz_compress_block(const config& cfg, void *block, size_t block_sz, int) {
+//
+// with cfg.sort the pairs of a round are counted up front by pz_sort_pairs, a
+// term packed into 64 bits of the key, and a pair repeated in the expression
+// as the round starts gets its rule where it is first seen. pairs that only
+// come about during the round wait for the next one.
+//
+
+uint64_t rz_key(const term_baseclass& x) {
+	return (uint64_t)x.first << 32 | (uint32_t)x.second;
+}
+
+std::vector<pz_pair_record> rz_repeats(const expression& expr, size_t *distinct) {
+
+	std::vector<pz_pair_record> records;
+	std::vector<pz_pair_record> repeats;
+
+	size_t i = 0;
+
+	for(auto pos = expr.begin(); pos != expr.end() and std::next(pos) != expr.end(); pos++, i++)
+		if(pos->second != std::next(pos)->second)
+			records.push_back({ rz_key(*pos), rz_key(*std::next(pos)), i });
+
+	pz_sort_pairs(records);
+
+	*distinct = 0;
+
+	for(size_t first = 0, last; first < records.size(); first = last) {
+
+		for(last = first + 1; last < records.size() and records[last].hi == records[first].hi and records[last].lo == records[first].lo; last++)
+			;
+
+		if(last - first > 1)
+			repeats.push_back(records[first]);
+
+		++*distinct;
+	}
+
+	return repeats;
+}
+
+bool rz_repeated(const std::vector<pz_pair_record>& repeats, const digram& y) {
+
+	const pz_pair_record key = { rz_key(y.first), rz_key(y.second), 0 };
+
+	return std::binary_search(repeats.begin(), repeats.end(), key, [](const pz_pair_record& a, const pz_pair_record& b) {
+		return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo;
+	});
+}
+
+void rz_forget_rule(rdictionary& r, const dictionary& d, symbol x) {
+
+	const expression& expr = d.at(x);
+
+	if(expr.size() == 2) {
+		auto rrule = r.find(digram(expr.front(), expr.back()));
+		if(rrule != r.end() and rrule->second == x)
+			r.erase(rrule);
+	}
+}
+
+void rz_inline_rule(dictionary& d, rdictionary& r, census& c, symbol x) {
+
+	const symbol t = c.parent(x);
+
+	expression& expr = d.at(x);
+	expression& parent = d.at(t);
+
+	rz_forget_rule(r, d, x);
+	rz_forget_rule(r, d, t);
+
+	for(const auto& y : expr) {
+		c.disown(d, y.second, x, y.first);
+		c.adopt(d, y.second, t, y.first);
+	}
+
+	c.disown(d, x, t);
+
+	auto pos = std::find_if(parent.begin(), parent.end(), [x](const term& y) { return y.second == x; });
+	pos = parent.erase(pos);
+	parent.splice(pos, expr);
+
+	d.erase(x);
+}
+
+bool rz_compress_block(const config& cfg, void *block, size_t block_sz, pz_writer& out, pz_block_stats *bs) {
 
 	expression expr((unsigned char *)block, (unsigned char *)block + block_sz);
 
 	dictionary d;
 	rdictionary r;
+	census c;
+
+	std::vector<symbol> recycled;
+	std::vector<symbol> released;
+	std::vector<symbol> pending;
 
-	size_t last_sz;
+	size_t created;
 	size_t round = 0;
+	bool induce = true;
+
+	pz_round_stats rs;
+
+	*cfg.log << std::endl;
+
+	auto new_rule = [&](const expression& bigram) -> symbol {
+
+		symbol key;
+
+		if(recycled.empty()) {
+			key = d.next_key();
+		} else {
+			key = recycled.back();
+			recycled.pop_back();
+		}
+
+		d[key] = bigram;
+
+		c.reserve(d);
+		c.enter(key, round);
+
+		for(const auto& y : bigram)
+			c.adopt(d, y.second, key, y.first);
 
-	std::cerr << std::endl;
+		created++;
+		rs.created++;
+
+		return key;
+	};
+
+	//
+	// singletons are lifted as they show up: rules from earlier rounds down to one use in
+	// the expression are expanded in place during the scan, rules down to one use inside
+	// another rule are spliced into it once the round is over. once the level is reached
+	// or no rules are created, a last scan only lifts.
+	//
+
+	pz_phase phase(bs, "induce");
 
 	do {
 
 		std::map <expression,size_t> histogram;
+		std::vector<pz_pair_record> repeats;
 
-		last_sz = d.size();
+		size_t distinct = 0;
 
-		std::cerr << "r: " << round << '/' << cfg.level << " d: " << d.size() << " e: " << expr.size() << std::endl;
+		created = 0;
 
-		if(round++ == cfg.level)
-			break;
+		rs = pz_round_stats();
+
+		if(bs != nullptr) {
+			rs.round = round;
+			rs.time = pz_clock::now();
+			rs.allocated = pz_heap::allocated();
+		}
+
+		*cfg.log << "r: " << round << '/' << cfg.level << " d: " << d.size() << " e: " << expr.size() << std::endl;
+
+		if(round == cfg.level)
+			induce = false;
+
+		if(cfg.sort and induce)
+			repeats = rz_repeats(expr, &distinct);
+
+		recycled.insert(recycled.end(), released.begin(), released.end());
+		released.clear();
 
 		auto pos = expr.begin();
 
-		while(std::next(pos) != expr.end()) {
+		while(pos != expr.end()) {
+
+			if(c.document_singleton(d, pos->second, round)) {
+
+				const symbol x = pos->second;
+				const expression& lifted = d.at(x);
+
+				rz_forget_rule(r, d, x);
+
+				for(const auto& y : lifted) {
+					c.disown(d, y.second, x, y.first);
+					c.cite(d, y.second, y.first);
+				}
+
+				c.uncite(d, x);
+
+				pos = expr.erase(pos);
+				pos = expr.insert(pos, lifted.begin(), lifted.end());
+
+				d.erase(x);
+				released.push_back(x);
+
+				rs.inlined++;
+
+				continue;
+			}
+
+			if(std::next(pos) == expr.end())
+				break;
 
 			if(pos->second == std::next(pos)->second) {
 
 				std::next(pos)->first += pos->first;
 				pos = expr.erase(pos);
 
-			} else {
+			} else if(induce) {
 
 				expression bigram(pos, std::next(pos,2));
+				const digram y(*pos, *std::next(pos));
 
-				auto rrule = r.find(bigram);
+				auto rrule = r.find(y);
 
-				if(++histogram[bigram] > 1 and rrule == r.end()) {
-					symbol key = d.next_key();
-					d[key] = bigram;
-					r[bigram] = key;
-					rrule = r.find(bigram);
-				}
+				const bool repeated = cfg.sort ? rz_repeated(repeats, y) : ++histogram[bigram] > 1;
+
+				if(repeated and rrule == r.end())
+					rrule = r.emplace(y, new_rule(bigram)).first;
 
 				if(rrule != r.end()) {
+
+					for(const auto& z : bigram) {
+						c.uncite(d, z.second, z.first);
+						if(c.nested_singleton(d, z.second))
+							pending.push_back(z.second);
+					}
+
+					c.cite(d, rrule->second);
+
 					pos = expr.erase(pos, std::next(pos,2));
 					pos = expr.insert(pos, rrule->second);
+
+					rs.replacements++;
+
 				} else {
 					pos++;
 				}
+
+			} else {
+				pos++;
 			}
 		}
 
-	} while(d.size() > last_sz);
+		for(symbol x : pending) {
+			if(c.nested_singleton(d, x)) {
+				rz_inline_rule(d, r, c, x);
+				released.push_back(x);
+				rs.inlined++;
+			}
+		}
 
-	std::map<symbol, size_t> singletons;
+		pending.clear();
 
-	for(const auto& x : expr)
-		singletons[x.second] += x.first;
+		if(bs != nullptr) {
+			rs.time = pz_clock::now() - rs.time;
+			rs.allocated = pz_heap::allocated() - rs.allocated;
+			rs.histogram = cfg.sort ? distinct : histogram.size();
+			rs.candidates = r.size();
+			rs.symbols = expr.size();
+			rs.rules = d.size();
+			bs->rounds.push_back(rs);
+		}
 
-	for(const auto& rule : d)
-		for(const auto& x : rule.second)
-			singletons[x.second] += x.first;
-
-	auto iter = singletons.begin();
-	while(iter != singletons.end())  {
-		if(iter->first >= 0 or iter->second > 1)
-			iter = singletons.erase(iter);
-		else
-			iter++;
-	}
+		round++;
 
-	auto lift = [&](expression::iterator pos) -> expression::iterator {
-		const symbol& s = pos->second;
-		auto singleton = singletons.find(s);
-		if(singleton != singletons.end()) {
-			auto rule = d.find(s);
-			const auto& x = rule->second;
-			expr.insert(pos, x.begin(), x.end());
-			pos = expr.erase(pos);
-			d.erase(s);
-		}
-		return pos;
-	};
+	} while(induce and created > 0);
 
 	size_t ss = 0;
 
-	for(auto pos = expr.begin(); pos != expr.end(); pos++)
-		pos = lift(pos);
-
-	for(auto& rule : d) {
-		for(auto pos = rule.second.begin(); pos != rule.second.end(); pos++)
-			pos = lift(pos);
+	for(const auto& rule : d)
 		++ss += rule.second.size();
+
+	*cfg.log << "dictionary entries: " << d.size() << std::endl;
+	*cfg.log << "dictionary size: " << ss << std::endl;
+	*cfg.log << "expression size: " << expr.size() << std::endl;
+
+	phase.stop();
+
+	if(bs != nullptr) {
+		for(const auto& rule : d) {
+			bs->rule_lengths[rule.second.size()]++;
+			bs->expansion_lengths[d.expansion_length(rule.first)]++;
+		}
 	}
 
-	std::cerr << "dictionary entries: " << d.size() << std::endl;
-	std::cerr << "dictionary size: " << ss << std::endl;
-	std::cerr << "expression size: " << expr.size() << std::endl;
+	pz_phase expand(bs, "expand");
 
 	d.expand(expr);
 
+	expand.stop();
+
+	pz_phase output(bs, "write");
+
 	for(auto x : expr)
-		std::cout << (char)x.second;
+		out.put((char)x.second);
 
-	return false;
+	if(bs != nullptr)
+		bs->output = expr.size();
+
+	return true;
 }
 
-bool rz_compress(const config& cfg, int fdin, int fdout) {
+bool rz_compress(const config& cfg, int fdin, int fdout, const char *name) {
 
 	constexpr size_t block_sz = (1 << 20);
 
@@ -261,8 +478,35 @@ bool rz_compress(const config& cfg, int fdin, int fdout) {
 
 	ssize_t n;
 
-	while((n = read_block(fdin, block, block_sz)) > 0)
-		rz_compress_block(cfg, block, n, fdout);
+	pz_writer out(fdout, cfg.direct);
+
+	for(;;) {
+
+		pz_block_stats stats;
+		pz_block_stats *bs = (cfg.stats != nullptr) ? &stats : nullptr;
+
+		pz_clock start;
+
+		if(bs != nullptr)
+			start = pz_clock::now();
+
+		pz_phase read(bs, "read");
+
+		if((n = read_block(fdin, block, block_sz)) <= 0)
+			break;
+
+		read.stop();
+
+		rz_compress_block(cfg, block, n, out, bs);
+
+		if(bs != nullptr) {
+			bs->input = n;
+			bs->time = pz_clock::now() - start;
+			cfg.stats->add(name, std::move(stats));
+		}
+	}
+
+	out.flush();
 
 	return (n != -1);
 }
@@ -271,8 +515,18 @@ bool rz_decompress(const config&, int, int) {
 	return false;
 }
 
-bool rz_process_fd(const config& cfg, int fdin, int fdout) {
-	return cfg.compress ? rz_compress(cfg, fdin, fdout) : rz_decompress(cfg, fdin, fdout);
+bool rz_process_fd(const config& cfg, int fdin, int fdout, const char *name) {
+
+	try {
+
+		return cfg.compress ? rz_compress(cfg, fdin, fdout, name) : rz_decompress(cfg, fdin, fdout);
+
+	} catch(const std::exception& e) {
+
+		*cfg.log << e.what() << std::endl;
+	}
+
+	return false;
 }
 
 bool rz_process_file(const config& cfg, const char *filenamein) {
@@ -281,15 +535,17 @@ bool rz_process_file(const config& cfg, const char *filenamein) {
 	int fdout;
 	struct stat sb;
 
-	std::cerr << std::setw(12) << filenamein << ": ";
+	std::string filenameout;
+
+	*cfg.log << std::setw(12) << filenamein << ": ";
 
 	if(lstat(filenamein, &sb) == -1) {
-		std::cerr << strerror(errno) << std::endl;
+		*cfg.log << strerror(errno) << std::endl;
 		return false;
 	}
 
 	if(S_ISDIR(sb.st_mode)) {
-		std::cerr << "ignoring directory" << std::endl;
+		*cfg.log << "ignoring directory" << std::endl;
 		return false;
 	}
 
@@ -299,7 +555,7 @@ bool rz_process_file(const config& cfg, const char *filenamein) {
 		// input type doesnt matter
 		// as long as it can be read
 
-		fdout = dup(STDOUT_FILENO);
+		fdout = dup(cfg.output);
 
 	} else {
 
@@ -307,7 +563,7 @@ bool rz_process_file(const config& cfg, const char *filenamein) {
 		// then only compress regular files
 
 		if(not S_ISREG(sb.st_mode)) {
-			std::cerr << "ignoring " << get_file_type(sb) << std::endl;
+			*cfg.log << "ignoring " << get_file_type(sb) << std::endl;
 			return false;
 		}
 
@@ -320,56 +576,95 @@ bool rz_process_file(const config& cfg, const char *filenamein) {
 
 		const char *p = filenamein + filenamein_sz;
 
-		std::string filenameout(filenamein);
+		filenameout = filenamein;
 
 		if(extension_sz < filenamein_sz)
 			p -= extension_sz;
 
 		if(strcmp(p, rz_extension) == 0) {
 			if(cfg.compress) {
-				std::cerr << "already has " << rz_extension << " suffix -- ignored" << std::endl;
+				*cfg.log << "already has " << rz_extension << " suffix -- ignored" << std::endl;
 				return false;
 			}
 			filenameout.erase(filenameout.end() - extension_sz, filenameout.end());
 		} else {
 			if(not cfg.compress) {
-				std::cerr << "unknown suffix -- ignored" << std::endl;
+				*cfg.log << "unknown suffix -- ignored" << std::endl;
 				return false;
 
 			}
 			filenameout += rz_extension;
 		}
 
-		std::cerr << "=> " << filenameout;
+		*cfg.log << "=> " << filenameout << std::endl;
 
 		fdout = open(filenameout.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0664);
 		if(fdout == -1) {
-			std::cerr << strerror(errno) << std::endl;
+			*cfg.log << strerror(errno) << std::endl;
 			return false;
 		}
 	}
 
 	fdin = open(filenamein, O_RDONLY);
 	if(fdin == -1) {
-		std::cerr << strerror(errno) << std::endl;
+		*cfg.log << strerror(errno) << std::endl;
 		close(fdout);
 		return false;
 	}
 
-	rz_process_fd(cfg, fdin, fdout);
-
-	std::cerr << std::endl;
+	const bool ok = rz_process_fd(cfg, fdin, fdout, filenamein);
 
 	close(fdin);
 	close(fdout);
 
-	return true;
+	// a failed output is not left behind, truncated or empty
+
+	if(not ok and not filenameout.empty())
+		unlink(filenameout.c_str());
+
+	return ok;
+}
+
+#ifdef PZ_FUZZ
+
+//
+// libfuzzer entry point, built by make fuzz. rzip cannot decompress yet, so
+// the input is only compressed, at the level its first byte picks, and must
+// not crash or hang
+//
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+
+	if(size == 0)
+		return 0;
+
+	std::ostream null(nullptr);
+
+	config cfg;
+
+	cfg.log = &null;
+	cfg.level = data[0] % 10;
+
+	int in = pz_memfd("in", data + 1, size - 1);
+	int out = pz_memfd("out", nullptr, 0);
+
+	if(not rz_process_fd(cfg, in, out, "fuzz"))
+		abort();
+
+	close(in);
+	close(out);
+
+	return 0;
 }
 
+#else
+
 int main(int argc, char **argv) {
 
 	config cfg;
 
+	cfg.takes = config::opt_jobs | config::opt_stats | config::opt_direct | config::opt_sort;
+
 	if(not cfg.getopt(argc, argv)) {
 		std::cerr << "Try `" << *argv << " -h' for more information." << std::endl;
 		return -1;
@@ -388,13 +683,35 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
+	std::unique_ptr<pz_stats> stats;
+
+	if(not cfg.statsfile.empty()) {
+		stats.reset(new pz_stats("rzip"));
+		cfg.stats = stats.get();
+		pz_heap::track(true);
+	}
+
+	bool ok = true;
+
 	if(cfg.files.empty()) {
 
-		rz_process_fd(cfg, STDIN_FILENO, STDOUT_FILENO);
+		ok = rz_process_fd(cfg, STDIN_FILENO, STDOUT_FILENO, "-");
+
+	} else if(cfg.jobs > 1) {
+
+		ok = run_jobs(cfg, rz_process_file);
 
 	} else
 		for(auto file : cfg.files)
-			rz_process_file(cfg, file.c_str());
+			ok = rz_process_file(cfg, file.c_str()) and ok;
 
-	return 0;
+	if(stats)
+		stats->peak_heap = pz_heap::peak();
+
+	if(stats and not stats->write(cfg.statsfile))
+		std::cerr << cfg.statsfile << ": " << strerror(errno) << std::endl;
+
+	return ok ? 0 : 1;
 }
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 enum struct symbol : int {
+    argument  = -257,
     wildcard  = -1,
     min_ascii = '\0',
     max_ascii = '\xff',
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+#include <stdexcept>
+
+//
+// rule_table
+//
+// a dictionary of rules whose keys are handed out densely, key(n) = Origin + Stride * n.
+// rules live in one flat vector indexed by symbol, so lookups are O(1) and iteration
+// walks memory in key order. erasing a rule only marks its slot dead, compact() closes
+// the gaps and returns the old index => new key mapping for renaming references.
+// reorder() does the same but puts the rules in the order of the keys it is given.
+//
+
+template <typename K, typename V, int Origin, int Stride = 1> struct rule_table {
+
+	static_assert(Stride == 1 or Stride == -1, "rule_table stride must be +1 or -1");
+
+	using key_type = K;
+	using mapped_type = V;
+	using value_type = std::pair<K,V>;
+	using size_type = std::size_t;
+
+	template <typename T, typename P> struct basic_iterator : std::iterator<std::forward_iterator_tag, T> {
+
+		P table;
+		size_type n;
+
+		basic_iterator(P t, size_type m) : table(t), n(m) {
+			skip();
+		}
+
+		void skip() {
+			while(n < table->slots.size() and not table->live[n])
+				n++;
+		}
+
+		T& operator*() const { return table->slots[n]; }
+		T *operator->() const { return &table->slots[n]; }
+
+		basic_iterator& operator++() { n++; skip(); return *this; }
+		basic_iterator operator++(int) { auto it = *this; operator++(); return it; }
+
+		bool operator==(const basic_iterator& r) const { return n == r.n; }
+		bool operator!=(const basic_iterator& r) const { return n != r.n; }
+	};
+
+	using iterator = basic_iterator<value_type, rule_table *>;
+	using const_iterator = basic_iterator<const value_type, const rule_table *>;
+
+	std::vector<value_type> slots;
+	std::vector<bool> live;
+	size_type count = 0;
+
+	static constexpr K key(size_type n) {
+		return K(Origin + Stride * (long)n);
+	}
+
+	static constexpr size_type index(K k) {
+		return (size_type)(((long)k - Origin) * Stride);
+	}
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, slots.size()); }
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, slots.size()); }
+
+	size_type size() const { return count; }
+	size_type extent() const { return slots.size(); }
+	bool empty() const { return count == 0; }
+
+	K next_key() const {
+		return key(slots.size());
+	}
+
+	bool contains(K k) const {
+		size_type n = index(k);
+		return n < slots.size() and live[n];
+	}
+
+	iterator find(K k) {
+		return contains(k) ? iterator(this, index(k)) : end();
+	}
+
+	const_iterator find(K k) const {
+		return contains(k) ? const_iterator(this, index(k)) : end();
+	}
+
+	V& at(K k) {
+		if(not contains(k))
+			throw std::out_of_range("rule_table::at(): no such rule");
+		return slots[index(k)].second;
+	}
+
+	const V& at(K k) const {
+		if(not contains(k))
+			throw std::out_of_range("rule_table::at(): no such rule");
+		return slots[index(k)].second;
+	}
+
+	V& operator[](K k) {
+
+		size_type n = index(k);
+
+		if(n >= slots.size()) {
+			while(slots.size() <= n)
+				slots.emplace_back(key(slots.size()), V());
+			live.resize(slots.size(), false);
+		}
+
+		if(not live[n]) {
+			live[n] = true;
+			count++;
+		}
+
+		return slots[n].second;
+	}
+
+	void erase(K k) {
+		if(contains(k)) {
+			size_type n = index(k);
+			slots[n].second = V();
+			live[n] = false;
+			count--;
+		}
+	}
+
+	iterator erase(iterator pos) {
+		erase(pos->first);
+		return ++pos;
+	}
+
+	void clear() {
+		slots.clear();
+		live.clear();
+		count = 0;
+	}
+
+	std::vector<K> compact() {
+
+		std::vector<K> remap(slots.size(), key(slots.size()));
+
+		size_type m = 0;
+
+		for(size_type n = 0; n < slots.size(); n++) {
+			if(live[n]) {
+				remap[n] = key(m);
+				if(m != n)
+					slots[m].second = std::move(slots[n].second);
+				slots[m].first = key(m);
+				m++;
+			}
+		}
+
+		slots.resize(m);
+		live.assign(m, true);
+
+		return remap;
+	}
+
+	std::vector<K> reorder(const std::vector<K>& order) {
+
+		// order names every live rule once, the rule at order[m] gets key(m)
+
+		std::vector<K> remap(slots.size(), key(slots.size()));
+		std::vector<value_type> moved;
+
+		moved.reserve(order.size());
+
+		for(size_type m = 0; m < order.size(); m++) {
+			size_type n = index(order[m]);
+			remap[n] = key(m);
+			moved.emplace_back(key(m), std::move(slots[n].second));
+		}
+
+		slots = std::move(moved);
+		live.assign(slots.size(), true);
+		count = slots.size();
+
+		return remap;
+	}
+};
+
+//
+// rule_census
+//
+// per rule use counts kept up to date while a grammar is being rewritten, split into
+// uses in the document and uses inside other rule bodies. owner is the xor of the keys
+// of every rule body term naming the rule, so once a rule is used exactly once inside
+// another rule, owner is that rule. born records the round a rule was created in.
+//
+
+template <typename D> struct rule_census {
+
+	using key_type = typename D::key_type;
+
+	std::vector<std::size_t> document;
+	std::vector<std::size_t> rules;
+	std::vector<long> owner;
+	std::vector<std::size_t> born;
+
+	void reserve(const D& d) {
+		document.resize(d.extent(), 0);
+		rules.resize(d.extent(), 0);
+		owner.resize(d.extent(), 0);
+		born.resize(d.extent(), 0);
+	}
+
+	void enter(key_type x, std::size_t round) {
+		auto n = D::index(x);
+		document[n] = rules[n] = 0;
+		owner[n] = 0;
+		born[n] = round;
+	}
+
+	void cite(const D& d, key_type x, std::size_t k = 1) {
+		if(d.contains(x))
+			document[D::index(x)] += k;
+	}
+
+	void uncite(const D& d, key_type x, std::size_t k = 1) {
+		if(d.contains(x))
+			document[D::index(x)] -= k;
+	}
+
+	void adopt(const D& d, key_type x, key_type parent, std::size_t k = 1) {
+		if(d.contains(x)) {
+			auto n = D::index(x);
+			rules[n] += k;
+			owner[n] ^= (long)parent;
+		}
+	}
+
+	void disown(const D& d, key_type x, key_type parent, std::size_t k = 1) {
+		if(d.contains(x)) {
+			auto n = D::index(x);
+			rules[n] -= k;
+			owner[n] ^= (long)parent;
+		}
+	}
+
+	key_type parent(key_type x) const {
+		return key_type(owner[D::index(x)]);
+	}
+
+	bool nested_singleton(const D& d, key_type x) const {
+		return d.contains(x) and document[D::index(x)] == 0 and rules[D::index(x)] == 1;
+	}
+
+	bool document_singleton(const D& d, key_type x, std::size_t round) const {
+		return d.contains(x) and document[D::index(x)] == 1 and rules[D::index(x)] == 0 and born[D::index(x)] < round;
+	}
+};
+
+//
+// pair_hash
+//
+// hash for std::pair keys (and pairs of pairs) so reverse rule lookups
+// can live in an unordered_map instead of an ordered tree.
+//
+
+struct pair_hash {
+
+	template <typename T> static typename std::enable_if<std::is_scalar<T>::value, std::size_t>::type hash(const T& x) {
+		return std::hash<T>()(x);
+	}
+
+	template <typename A, typename B> static std::size_t hash(const std::pair<A,B>& x) {
+		std::size_t h = hash(x.first);
+		return h ^ (hash(x.second) + 0x9e3779b9 + (h << 6) + (h >> 2));
+	}
+
+	template <typename A, typename B> std::size_t operator()(const std::pair<A,B>& x) const {
+		return hash(x);
+	}
+};